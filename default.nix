@@ -7,7 +7,7 @@ pkgs.stdenv.mkDerivation {
 
   src = ./.;
 
-  buildInputs = with pkgs; [ libarchive zip ];
+  buildInputs = with pkgs; [ libarchive zlib zip ];
 
   buildPhase = ''
     runHook preBild
@@ -1,5 +1,5 @@
 { pkgs ? import <nixpkgs> {} }:
 
 pkgs.mkShell {
-  buildInputs = with pkgs; [ libarchive gnumake gcc zip unzip valgrind ];
+  buildInputs = with pkgs; [ libarchive zlib gnumake gcc zip unzip valgrind ];
 }
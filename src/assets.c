@@ -0,0 +1,127 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "assets.h"
+
+struct asset {
+	char *name;
+	size_t name_len;
+	char *fingerprint;
+	size_t fingerprint_len;
+};
+
+/* There are only ever a handful, so a list is plenty. */
+static struct asset *assets;
+static size_t count;
+
+int
+assets_refers(const char *mime_type)
+{
+	return strncmp(mime_type, "text/css", 8) == 0;
+}
+
+int
+assets_rank(int is_markup, const char *mime_type)
+{
+	return is_markup ? 2 : assets_refers(mime_type) ? 1 : 0;
+}
+
+const char *
+assets_add(const char *name, uint64_t hash)
+{
+	struct asset *grown = realloc(assets, (count + 1) * sizeof(*grown));
+	if (!grown) return NULL;
+	assets = grown;
+
+	// the hash goes before the extension, so that anything going by the
+	// extension still sees the right one: styles.css is styles.<hash>.css.
+	const char *ext = strrchr(name, '.');
+	size_t stem = ext ? (size_t) (ext - name) : strlen(name);
+	if (!ext) ext = "";
+
+	size_t len = strlen(name) + 17;
+	char *fingerprint = malloc(len + 1);
+	char *copy = strdup(name);
+	if (!fingerprint || !copy) {
+		free(fingerprint);
+		free(copy);
+		return NULL;
+	}
+
+	snprintf(fingerprint, len + 1, "%.*s.%016llx%s", (int) stem, name,
+		(unsigned long long) hash, ext);
+
+	assets[count++] = (struct asset) {
+		.name = copy,
+		.name_len = strlen(copy),
+		.fingerprint = fingerprint,
+		.fingerprint_len = len,
+	};
+
+	return fingerprint;
+}
+
+static int
+opens(char c)
+{
+	return c == '"' || c == '\'' || c == '(';
+}
+
+static int
+closes(char c)
+{
+	return c == '"' || c == '\'' || c == ')' || c == '?' || c == '#';
+}
+
+/* The asset referred to at text + i, if any. */
+static const struct asset *
+reference_at(const char *text, size_t len, size_t i)
+{
+	if (i == 0) return NULL;
+
+	// "name", or "/name".
+	int quoted = opens(text[i - 1])
+		|| (i >= 2 && text[i - 1] == '/' && opens(text[i - 2]));
+	if (!quoted) return NULL;
+
+	for (size_t j = 0; j < count; j++) {
+		const struct asset *a = &assets[j];
+		if (a->name_len < len - i
+				&& memcmp(text + i, a->name, a->name_len) == 0
+				&& closes(text[i + a->name_len]))
+			return a;
+	}
+
+	return NULL;
+}
+
+char *
+assets_rewrite(const char *text, size_t len, size_t *out_len)
+{
+	// measure, then copy.
+	size_t need = len;
+	for (size_t i = 0; i < len; i++) {
+		const struct asset *a = reference_at(text, len, i);
+		if (a) need += a->fingerprint_len - a->name_len;
+	}
+
+	char *out = malloc(need + 1);
+	if (!out) return NULL;
+
+	size_t at = 0;
+	for (size_t i = 0; i < len;) {
+		const struct asset *a = reference_at(text, len, i);
+		if (a) {
+			memcpy(out + at, a->fingerprint, a->fingerprint_len);
+			at += a->fingerprint_len;
+			i += a->name_len;
+		} else {
+			out[at++] = text[i++];
+		}
+	}
+
+	out[at] = '\0';
+	*out_len = at;
+	return out;
+}
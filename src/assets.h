@@ -0,0 +1,32 @@
+#include <stddef.h>
+#include <stdint.h>
+
+/* Static assets (anything that isn't markup) are served under their own name,
+ * and under a fingerprinted one with their content hash in it, which can be
+ * cached forever. Pages and stylesheets refer to assets by their fingerprinted
+ * names, so a deploy that changes an asset changes every link to it. */
+
+/* The header added to responses under a fingerprinted name. */
+#define ASSETS_CACHE_CONTROL "Cache-Control: public, max-age=31536000, immutable\r\n"
+
+/* Whether content of this mime type can refer to other assets, and has to be
+ * rewritten, and so fingerprinted after them. */
+int assets_refers(const char *mime_type);
+
+/* Where an entry goes in loading order: assets that can't refer to anything
+ * come first, then assets that can, then pages. That way everything is
+ * fingerprinted before anything referring to it is rewritten. */
+#define ASSETS_RANKS 3
+int assets_rank(int is_markup, const char *mime_type);
+
+/* Register the asset called name, whose body has the given routes_hash().
+ * Returns its fingerprinted name, which lives as long as the process, or NULL
+ * on OOM. */
+const char *assets_add(const char *name, uint64_t hash);
+
+/* Rewrite every reference to a registered asset in the len bytes at text to
+ * use its fingerprinted name. A reference is the asset's name, or its name
+ * after a /, right inside quotes or parens. Returns the allocated,
+ * null-terminated result and sets its length, or returns NULL on OOM. Safe to
+ * call from any thread once no more assets are being added. */
+char *assets_rewrite(const char *text, size_t len, size_t *out_len);
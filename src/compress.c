@@ -0,0 +1,186 @@
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <zlib.h>
+
+#ifdef WITH_BROTLI
+#include <brotli/encode.h>
+#endif
+#ifdef WITH_ZSTD
+#include <zstd.h>
+#endif
+
+#include "routes.h"
+#include "compress.h"
+
+static char *
+compress_gzip(const char *in, size_t len, size_t *out_len)
+{
+	z_stream z;
+	memset(&z, 0, sizeof(z));
+
+	// a window of 15 bits, plus 16 for a gzip wrapper.
+	if (deflateInit2(&z, Z_BEST_COMPRESSION, Z_DEFLATED, 15 + 16, 9,
+			Z_DEFAULT_STRATEGY) != Z_OK)
+		return NULL;
+
+	size_t cap = deflateBound(&z, len);
+	char *out = malloc(cap);
+
+	z.next_in = (unsigned char *) in;
+	z.avail_in = len;
+	z.next_out = (unsigned char *) out;
+	z.avail_out = cap;
+	if (out && deflate(&z, Z_FINISH) != Z_STREAM_END) {
+		free(out);
+		out = NULL;
+	}
+
+	*out_len = z.total_out;
+	deflateEnd(&z);
+	return out;
+}
+
+#ifdef WITH_BROTLI
+static char *
+compress_br(const char *in, size_t len, size_t *out_len)
+{
+	*out_len = BrotliEncoderMaxCompressedSize(len);
+	char *out = malloc(*out_len ? *out_len : 1);
+	if (!out) return NULL;
+
+	if (!BrotliEncoderCompress(BROTLI_MAX_QUALITY, BROTLI_DEFAULT_WINDOW,
+			BROTLI_DEFAULT_MODE, len, (const uint8_t *) in, out_len,
+			(uint8_t *) out)) {
+		free(out);
+		return NULL;
+	}
+
+	return out;
+}
+#endif
+
+#ifdef WITH_ZSTD
+static char *
+compress_zstd(const char *in, size_t len, size_t *out_len)
+{
+	size_t cap = ZSTD_compressBound(len);
+	char *out = malloc(cap);
+	if (!out) return NULL;
+
+	*out_len = ZSTD_compress(out, cap, in, len, 19);
+	if (ZSTD_isError(*out_len)) {
+		free(out);
+		return NULL;
+	}
+
+	return out;
+}
+#endif
+
+char *
+compress_body(enum route_encoding encoding, const char *in, size_t len,
+	size_t *out_len)
+{
+	switch (encoding) {
+#ifdef WITH_BROTLI
+	case ENCODING_BR: return compress_br(in, len, out_len);
+#endif
+#ifdef WITH_ZSTD
+	case ENCODING_ZSTD: return compress_zstd(in, len, out_len);
+#endif
+	case ENCODING_GZIP: return compress_gzip(in, len, out_len);
+	default: return NULL;
+	}
+}
+
+/* Routes waiting to be compressed, by index, and the one thread that works
+ * through them. It's started by the first compress_route() call, while the
+ * routes load, and lives for the life of the process. */
+static struct {
+	pthread_mutex_t lock;
+	pthread_cond_t more;
+	size_t *queue;
+	size_t len;
+	size_t cap;
+	int started;
+} bg = {
+	.lock = PTHREAD_MUTEX_INITIALIZER,
+	.more = PTHREAD_COND_INITIALIZER,
+};
+
+static void
+compress_now(size_t index)
+{
+	const struct response_body *body = routes_ready(&routes.routes[index].body);
+	if (!body || !routes_compressible(body->mime_type)) return;
+
+	for (int i = 0; i < ENCODINGS; i++) {
+		if (__atomic_load_n(&body->encoded[i], __ATOMIC_ACQUIRE)) return;
+	}
+
+	for (int i = 0; i < ENCODINGS; i++) {
+		size_t len;
+		char *text = compress_body(i, body->text, body->len, &len);
+		if (!text) continue;
+
+		if (len >= body->len || routes_attach_encoded(index, i, text, len) != 0)
+			free(text);
+	}
+}
+
+static void *
+compress_worker(void *arg)
+{
+	(void) arg;
+
+	for (;;) {
+		pthread_mutex_lock(&bg.lock);
+		while (bg.len == 0)
+			pthread_cond_wait(&bg.more, &bg.lock);
+
+		// first in, first out, so pages get done in load order.
+		size_t index = bg.queue[0];
+		memmove(bg.queue, bg.queue + 1, --bg.len * sizeof(*bg.queue));
+		pthread_mutex_unlock(&bg.lock);
+
+		compress_now(index);
+	}
+
+	return NULL;
+}
+
+void
+compress_route(size_t index)
+{
+	pthread_mutex_lock(&bg.lock);
+
+	if (!bg.started) {
+		pthread_t t;
+		if (pthread_create(&t, NULL, compress_worker, NULL) != 0) {
+			// no thread, no copies; everything's still served.
+			printf("compress_route: can't start a thread\n");
+			bg.started = -1;
+		} else {
+			pthread_detach(t);
+			bg.started = 1;
+		}
+	}
+
+	if (bg.started > 0 && bg.len == bg.cap) {
+		size_t cap = bg.cap ? bg.cap * 2 : 64;
+		size_t *grown = realloc(bg.queue, cap * sizeof(*grown));
+		if (grown) {
+			bg.queue = grown;
+			bg.cap = cap;
+		}
+	}
+
+	if (bg.started > 0 && bg.len < bg.cap) {
+		bg.queue[bg.len++] = index;
+		pthread_cond_signal(&bg.more);
+	}
+
+	pthread_mutex_unlock(&bg.lock);
+}
@@ -0,0 +1,17 @@
+#include <stddef.h>
+
+/* Needs routes.h. */
+
+/* Compress len bytes at in. Returns the allocated result and sets its length,
+ * or returns NULL on OOM or if this build can't produce that encoding. gzip is
+ * always available; brotli and zstd only if built with WITH_BROTLI and
+ * WITH_ZSTD. */
+char *compress_body(enum route_encoding, const char *in, size_t len,
+	size_t *out_len);
+
+/* Compress the route at index in the background, in every encoding that makes
+ * it smaller, and attach the copies to it as they're done. Until then it's
+ * served as it is. Lazy routes are filled first. Routes that aren't worth
+ * compressing, or that already have a compressed copy, are left alone. The
+ * route store must be sealed. Safe to call from any thread. */
+void compress_route(size_t index);
@@ -0,0 +1,100 @@
+#include <string.h>
+
+#include "image.h"
+#include "routes.h"
+
+/* Check that off names a null-terminated string inside the metadata. */
+static int
+valid_string(const unsigned char *img, uint64_t meta_end, uint64_t off)
+{
+	return off >= sizeof(struct image_header) && off < meta_end
+		&& memchr(img + off, '\0', meta_end - off) != NULL;
+}
+
+enum image_result
+image_load(const unsigned char *map, size_t len)
+{
+	struct image_trailer trailer;
+	if (len < sizeof(trailer)) return IMAGE_NONE;
+
+	memcpy(&trailer, map + len - sizeof(trailer), sizeof(trailer));
+	if (memcmp(trailer.magic, IMAGE_MAGIC, sizeof(trailer.magic)) != 0)
+		return IMAGE_NONE;
+
+	// the image sits at some unaligned offset after server.bin, so the
+	// header and records are copied out rather than read in place.
+	struct image_header hdr;
+	if (trailer.size > len
+			|| trailer.size < sizeof(hdr) + sizeof(trailer))
+		return IMAGE_BAD;
+
+	const unsigned char *img = map + len - trailer.size;
+	memcpy(&hdr, img, sizeof(hdr));
+
+	if (memcmp(hdr.magic, IMAGE_MAGIC, sizeof(hdr.magic)) != 0
+			|| hdr.version != IMAGE_VERSION
+			|| hdr.size != trailer.size)
+		return IMAGE_BAD;
+
+	uint64_t body_end = hdr.size - sizeof(trailer);
+	if (hdr.meta_len > body_end - sizeof(hdr)
+			|| hdr.count > hdr.meta_len / sizeof(struct image_route))
+		return IMAGE_BAD;
+
+	uint64_t meta_end = sizeof(hdr) + hdr.meta_len;
+	if (routes_hash(img + sizeof(hdr), hdr.meta_len) != hdr.meta_sum)
+		return IMAGE_BAD;
+
+	for (uint32_t i = 0; i < hdr.count; i++) {
+		struct image_route rec;
+		memcpy(&rec, img + sizeof(hdr) + i * sizeof(rec), sizeof(rec));
+
+		if (!valid_string(img, meta_end, rec.key)
+				|| !valid_string(img, meta_end, rec.mime_type)
+				|| rec.body < meta_end || rec.body > body_end
+				|| rec.len > body_end - rec.body
+				|| rec.status < 100 || rec.status > 599)
+			return IMAGE_BAD;
+
+		// copies and fingerprinted names come after the route they
+		// belong to. a fingerprinted name belongs to a route proper,
+		// and a copy to either of those.
+		if (rec.base) {
+			struct image_route base;
+			if (rec.base > i || rec.encoding >= ENCODINGS)
+				return IMAGE_BAD;
+
+			memcpy(&base, img + sizeof(hdr) + (rec.base - 1) * sizeof(base),
+				sizeof(base));
+			if (base.base && ((rec.flags & IMAGE_FINGERPRINT)
+					|| !(base.flags & IMAGE_FINGERPRINT)))
+				return IMAGE_BAD;
+		}
+	}
+
+	// every record adds exactly one route, so record i is route first + i.
+	size_t first = routes.count;
+
+	for (uint32_t i = 0; i < hdr.count; i++) {
+		struct image_route rec;
+		memcpy(&rec, img + sizeof(hdr) + i * sizeof(rec), sizeof(rec));
+
+		const char *key = (const char *) img + rec.key;
+		const char *body = (const char *) img + rec.body;
+		ssize_t index;
+
+		if (!rec.base) {
+			index = routes_add_ref(key, (const char *) img + rec.mime_type,
+				rec.status, body, rec.len, rec.mtime, rec.content_hash);
+		} else if (rec.flags & IMAGE_FINGERPRINT) {
+			index = routes_add_fingerprint(key, first + rec.base - 1);
+		} else {
+			index = routes_add_encoded(first + rec.base - 1, rec.encoding,
+				body, rec.len);
+		}
+
+		if (index < 0) return IMAGE_OOM;
+	}
+
+	return IMAGE_OK;
+}
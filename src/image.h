@@ -0,0 +1,77 @@
+#include <stddef.h>
+#include <stdint.h>
+
+/* A route image is every route, rendered and ready to serve, laid out so the
+ * server can use it straight from the mapped executable. It's produced at
+ * build time by tools/mkimage and appended to server.bin:
+ *
+ *	header | records | strings | bodies | trailer
+ *
+ * Offsets are from the start of the header. Integers are in the byte order of
+ * the machine that built the image, which is the one that runs it. Strings
+ * are null-terminated.
+ *
+ * A route may be followed by records for compressed copies of its body, which
+ * name it as their base. An asset is followed by a record for its
+ * fingerprinted name, which names it as its base too, and then that record's
+ * own copies. */
+
+#define IMAGE_MAGIC "talimage"
+#define IMAGE_VERSION 4
+
+struct image_header {
+	char magic[8];
+	uint32_t version;
+	uint32_t count;
+
+	// the records and strings, which are checksummed. bodies aren't, so
+	// that validating an image doesn't scale with the content in it.
+	uint64_t meta_len;
+	uint64_t meta_sum;
+
+	// the whole image, header to trailer.
+	uint64_t size;
+};
+
+struct image_route {
+	uint64_t key;
+	uint64_t mime_type;
+	uint64_t body;
+	uint64_t len;
+
+	// routes_hash() of the body, which the ETag is made from.
+	uint64_t content_hash;
+
+	// when the file the route was made from was last modified.
+	uint64_t mtime;
+
+	uint32_t status;
+
+	// for a compressed copy: its enum route_encoding, and the index of
+	// the record it's a copy of, plus one. for a fingerprinted name, the
+	// index of the record it's a name for, plus one. base is zero
+	// otherwise.
+	uint32_t encoding;
+	uint32_t base;
+	uint32_t flags;
+};
+
+#define IMAGE_FINGERPRINT 1
+
+/* The last bytes of the executable, so the image can be found from the end. */
+struct image_trailer {
+	uint64_t size;
+	char magic[8];
+};
+
+enum image_result {
+	IMAGE_OK,
+	IMAGE_NONE,
+	IMAGE_BAD,
+	IMAGE_OOM,
+};
+
+/* Look for a route image at the end of the len bytes at map, validate it, and
+ * add a route for each record, served in place. Returns IMAGE_NONE, having
+ * added nothing, if there's no image there at all. */
+enum image_result image_load(const unsigned char *map, size_t len);
@@ -0,0 +1,549 @@
+#include <archive.h>
+#include <archive_entry.h>
+
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "assets.h"
+#include "image.h"
+#include "load.h"
+#include "markup.h"
+#include "routes.h"
+#include "compress.h"
+#include "startup.h"
+#include "zip.h"
+
+/* The executable, mapped once at startup. A route image at its end, or entries
+ * stored uncompressed in a zip archive there, are served straight out of the
+ * mapping. */
+static const unsigned char *self_map;
+static size_t self_len;
+
+/* An archive entry on its way to becoming a route. Preparing it (inflating and
+ * rendering) is the slow part, and may happen on any thread. Publishing it
+ * touches the route store, so that happens on the loading thread, in archive
+ * order. */
+struct pending_route {
+	char *name;
+
+	// the entry's data. if in_place is set, it's part of the mapped
+	// executable; otherwise it's owned, and freed once published.
+	const char *block;
+	size_t len;
+	int in_place;
+	time_t mtime;
+
+	// the routes_hash() of an in-place block, worked out while preparing
+	// so that it's spread over the loader threads too.
+	uint64_t hash;
+
+	const char *mime_type;
+	int status;
+	char *html;
+
+	const char *error;
+};
+
+static int
+map_self(void)
+{
+	int fd = open("/proc/self/exe", O_RDONLY | O_CLOEXEC);
+	if (fd < 0) return 1;
+
+	struct stat st;
+	void *map = MAP_FAILED;
+	if (fstat(fd, &st) == 0 && st.st_size > 0)
+		map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+
+	if (map == MAP_FAILED) return 1;
+
+	self_map = map;
+	self_len = st.st_size;
+	return 0;
+}
+
+static void
+prepare_route(struct pending_route *p)
+{
+	if (routes_classify(p->name, &p->mime_type, &p->status)) {
+		uint64_t start = startup_now();
+		p->html = render_markup(p->block, p->len);
+		startup_add(STARTUP_RENDER, start);
+		if (!p->html) p->error = "OOM rendering markup";
+	} else if (p->in_place) {
+		p->hash = routes_hash(p->block, p->len);
+	}
+}
+
+static void
+free_pending(struct pending_route *p)
+{
+	if (!p->in_place) free((char *) p->block);
+	free(p->html);
+	free(p->name);
+}
+
+/* Point the references to assets in a prepared page or stylesheet at their
+ * fingerprinted names. Every asset it might refer to must have been published
+ * already. Returns nonzero on OOM. */
+static int
+rewrite_route(struct pending_route *p)
+{
+	size_t len;
+
+	if (p->html) {
+		char *html = assets_rewrite(p->html, strlen(p->html), &len);
+		if (!html) return 1;
+
+		free(p->html);
+		p->html = html;
+	} else if (assets_refers(p->mime_type)) {
+		char *text = assets_rewrite(p->block, p->len, &len);
+		if (!text) return 1;
+
+		if (!p->in_place) free((char *) p->block);
+		p->block = text;
+		p->len = len;
+		p->in_place = 0;
+	}
+
+	return 0;
+}
+
+/* Add a prepared and rewritten route to the store, along with its
+ * fingerprinted name if it's an asset. Unless it needed rendering or
+ * rewriting, an in-place entry is served from the mapping. */
+static int
+publish_route(struct pending_route *p)
+{
+	ssize_t index;
+
+	if (p->html) {
+		index = routes_add(p->name, p->mime_type, p->status, p->html, -1,
+			p->mtime);
+	} else if (p->in_place) {
+		index = routes_add_ref(p->name, p->mime_type, p->status,
+			p->block, p->len, p->mtime, p->hash);
+	} else {
+		index = routes_add(p->name, p->mime_type, p->status,
+			p->block, p->len, p->mtime);
+	}
+
+	if (index >= 0 && !p->html) {
+		const char *fingerprint
+			= assets_add(p->name, routes.routes[index].body.hash);
+		index = fingerprint ? routes_add_fingerprint(fingerprint, index) : -1;
+	}
+
+	if (index >= 0 && strcmp(p->name, "index") == 0)
+		index = routes_alias("", index);
+
+	return index < 0;
+}
+
+/* Rewrite and publish every prepared route in pending, in assets_rank()
+ * order, then free them all. Unnamed routes are skipped. who is for logging.
+ * Returns nonzero, having said why, if anything failed to prepare or publish;
+ * some routes may have been added by then. */
+static int
+publish_all(struct pending_route *pending, size_t count, const char *who)
+{
+	int err = 0;
+
+	for (size_t i = 0; i < count && !err; i++) {
+		if (pending[i].name && pending[i].error) {
+			printf("%s: %s: %s\n", who, pending[i].name, pending[i].error);
+			err = 1;
+		}
+	}
+
+	for (int rank = 0; rank < ASSETS_RANKS && !err; rank++) {
+		for (size_t i = 0; i < count && !err; i++) {
+			struct pending_route *p = &pending[i];
+			if (!p->name || assets_rank(p->html != NULL, p->mime_type) != rank)
+				continue;
+
+			if (rewrite_route(p) != 0 || publish_route(p) != 0) {
+				printf("%s: OOM\n", who);
+				err = 1;
+			}
+		}
+	}
+
+	for (size_t i = 0; i < count; i++) {
+		if (pending[i].name) free_pending(&pending[i]);
+	}
+
+	return err;
+}
+
+/* The entries of a mapped zip, handed out to workers one at a time. */
+static struct {
+	const struct zip_entry *entries;
+	struct pending_route *pending;
+	size_t count;
+	size_t next;
+} work;
+
+static void
+prepare_zip_entry(const struct zip_entry *e, struct pending_route *p)
+{
+	p->len = e->size;
+	p->in_place = e->method == ZIP_STORED;
+	p->mtime = e->mtime;
+
+	if (p->in_place) {
+		p->block = (const char *) e->data;
+	} else {
+		uint64_t start = startup_now();
+		char *buf = malloc(e->size ? e->size : 1);
+		p->block = buf;
+
+		if (!buf) {
+			p->error = "OOM inflating";
+			return;
+		} else if (zip_inflate(e, (unsigned char *) buf) != 0) {
+			p->error = "corrupt";
+			return;
+		}
+
+		startup_add(STARTUP_INFLATE, start);
+	}
+
+	prepare_route(p);
+}
+
+static void *
+zip_worker(void *arg)
+{
+	for (;;) {
+		size_t i = __atomic_fetch_add(&work.next, 1, __ATOMIC_RELAXED);
+		if (i >= work.count) return NULL;
+
+		if (work.pending[i].name)
+			prepare_zip_entry(&work.entries[i], &work.pending[i]);
+	}
+}
+
+/* A zip entry that's loaded on first request. */
+struct lazy_entry {
+	const struct zip_entry *entry;
+	char *name;
+	size_t index;
+};
+
+static char *
+fill_lazy_entry(void *arg, size_t *len)
+{
+	const struct lazy_entry *l = arg;
+	struct pending_route p = { .name = l->name };
+
+	prepare_zip_entry(l->entry, &p);
+	if (!p.error && rewrite_route(&p) != 0)
+		p.error = "OOM rewriting";
+
+	if (p.error) {
+		printf("fill_lazy_entry: %s: %s\n", l->name, p.error);
+		p.name = NULL;
+		free_pending(&p);
+		return NULL;
+	}
+
+	// now there's something to compress. the compressor waits for this
+	// fill to finish.
+	compress_route(l->index);
+
+	// entries that aren't markup are never lazy, so whatever we have here
+	// is owned: the rendered page.
+	if (p.html) {
+		if (!p.in_place) free((char *) p.block);
+		*len = strlen(p.html);
+		return p.html;
+	}
+
+	*len = p.len;
+	return (char *) p.block;
+}
+
+/* Index a mapped zip, rendering nothing: pages are added as lazy routes.
+ * Assets are loaded eagerly, since they have to be fingerprinted before any
+ * page can refer to them, but stored ones are still served in place. So is
+ * the 404 page, since the route store needs it to be ready. entries must
+ * outlive the process. */
+static int
+index_mapped_zip(const struct zip_entry *entries, size_t count)
+{
+	struct lazy_entry *lazy = calloc(count ? count : 1, sizeof(*lazy));
+	if (!lazy) return 1;
+
+	for (int rank = 0; rank < ASSETS_RANKS; rank++) {
+		for (size_t i = 0; i < count; i++) {
+			const struct zip_entry *e = &entries[i];
+			if (e->name_len > 0 && e->name[e->name_len - 1] == '/')
+				continue;
+
+			struct pending_route p = { .name = strndup(e->name, e->name_len) };
+			if (!p.name) return 1;
+
+			int is_markup = routes_classify(p.name, &p.mime_type, &p.status);
+			ssize_t index;
+
+			if (assets_rank(is_markup, p.mime_type) != rank) {
+				free(p.name);
+				continue;
+			}
+
+			if (strcmp(p.name, "404") == 0 || !is_markup) {
+				prepare_zip_entry(e, &p);
+				if (!p.error && rewrite_route(&p) != 0)
+					p.error = "OOM rewriting";
+
+				if (p.error) {
+					printf("index_mapped_zip: %s: %s\n", p.name, p.error);
+					return 1;
+				}
+
+				int err = publish_route(&p);
+				free_pending(&p);
+				if (err) return 1;
+				continue;
+			}
+
+			lazy[i].entry = e;
+			lazy[i].name = p.name;
+			index = routes_add_lazy(p.name, p.mime_type, p.status,
+				fill_lazy_entry, &lazy[i], e->mtime);
+			lazy[i].index = index;
+
+			if (index >= 0 && strcmp(p.name, "index") == 0)
+				index = routes_alias("", index);
+			if (index < 0) return 1;
+		}
+	}
+
+	return 0;
+}
+
+static int
+load_threads(const struct load_opts *opts, size_t jobs)
+{
+	long n = opts->threads;
+	if (n <= 0) n = sysconf(_SC_NPROCESSORS_ONLN);
+	if (n <= 0) n = 1;
+	if ((size_t) n > jobs) n = jobs;
+
+	return n > 0 ? n : 1;
+}
+
+/* Load routes by reading the archive's central directory ourselves. Stored
+ * entries are never copied; deflated ones are inflated once. Inflating and
+ * rendering is spread across a pool of threads, and the results are published
+ * once they've all finished. Returns nonzero, before adding any routes, if the
+ * archive isn't something we can handle in place. */
+static int
+read_mapped_zip(const struct load_opts *opts)
+{
+	struct zip_entry *entries;
+	size_t count;
+
+	uint64_t start = startup_now();
+	if (zip_index(self_map, self_len, &entries, &count) != 0)
+		return 1;
+	startup_add(STARTUP_OPEN, start);
+
+	for (size_t i = 0; i < count; i++) {
+		if (entries[i].method != ZIP_STORED
+				&& entries[i].method != ZIP_DEFLATED) {
+			free(entries);
+			return 1;
+		}
+	}
+
+	if (opts->lazy) {
+		start = startup_now();
+		if (index_mapped_zip(entries, count) != 0) goto oom;
+		startup_add(STARTUP_TABLE, start);
+		return 0;
+	}
+
+	struct pending_route *pending = calloc(count ? count : 1, sizeof(*pending));
+	if (!pending) goto oom;
+
+	for (size_t i = 0; i < count; i++) {
+		const struct zip_entry *e = &entries[i];
+
+		// directories don't serve anything, so they get no name and
+		// are skipped.
+		if (e->name_len > 0 && e->name[e->name_len - 1] == '/')
+			continue;
+
+		pending[i].name = strndup(e->name, e->name_len);
+		if (!pending[i].name) goto oom;
+	}
+
+	work.entries = entries;
+	work.pending = pending;
+	work.count = count;
+	work.next = 0;
+
+	int nthreads = load_threads(opts, count);
+	pthread_t *threads = calloc(nthreads, sizeof(*threads));
+	if (!threads) goto oom;
+
+	// the loading thread is a worker too, so n threads means n - 1 more.
+	int started = 0;
+	while (started < nthreads - 1
+			&& pthread_create(&threads[started], NULL, zip_worker, NULL) == 0)
+		started++;
+
+	zip_worker(NULL);
+	for (int i = 0; i < started; i++)
+		pthread_join(threads[i], NULL);
+	free(threads);
+
+	start = startup_now();
+	int err = publish_all(pending, count, "read_mapped_zip");
+	startup_add(STARTUP_TABLE, start);
+	free(pending);
+	free(entries);
+
+	// past this point some routes may have been added, so a failure is
+	// fatal rather than a reason to fall back to libarchive.
+	if (err) exit(1);
+	return 0;
+
+oom:
+	printf("read_mapped_zip: OOM\n");
+	exit(1);
+}
+
+/* Load routes through libarchive, copying every entry. Slower, but it reads
+ * anything. */
+static int
+read_archive_for_routes(void)
+{
+	int r;
+	struct pending_route *pending = NULL;
+	size_t count = 0;
+
+	struct archive *a = archive_read_new();
+	archive_read_support_filter_all(a);
+	archive_read_support_format_zip(a);
+
+	r = self_map
+		? archive_read_open_memory(a, self_map, self_len)
+		: archive_read_open_filename(a, "/proc/self/exe", 10240);
+	if (r != ARCHIVE_OK) {
+		printf("read_archive_for_routes: archive_read_open: %d\n", r);
+		return 1;
+	}
+
+	struct archive_entry *aent;
+	for (;;) {
+		r = archive_read_next_header(a, &aent);
+
+		if (r == ARCHIVE_EOF) break;
+		if (r != ARCHIVE_OK) {
+			printf("read_archive_for_routes: archive_read_next_header: %d\n", r);
+			return 1;
+		}
+
+		// nothing can be published until every asset has been read.
+		struct pending_route *grown
+			= realloc(pending, (count + 1) * sizeof(*pending));
+		if (!grown) {
+			printf("read_archive_for_routes: OOM\n");
+			return 1;
+		}
+
+		pending = grown;
+		struct pending_route *p = &pending[count++];
+		*p = (struct pending_route) {
+			.name = strdup(archive_entry_pathname(aent)),
+			.len = archive_entry_size(aent),
+			.mtime = archive_entry_mtime(aent),
+		};
+
+		char *buf = malloc(p->len ? p->len : 1);
+		p->block = buf;
+		if (!buf || !p->name) {
+			printf("read_archive_for_routes: OOM\n");
+			return 1;
+		}
+
+		ssize_t n = archive_read_data(a, buf, p->len);
+		if (n < 0 || (size_t) n != p->len) {
+			const char *why = n < 0 ? archive_error_string(a) : NULL;
+			printf("read_archive_for_routes: archive_read_data: %s: %s\n",
+				p->name, why ? why : "short read");
+			return 1;
+		}
+
+		prepare_route(p);
+	}
+
+	archive_read_free(a);
+
+	int err = publish_all(pending, count, "read_archive_for_routes");
+	free(pending);
+	return err;
+}
+
+int
+load_routes(const struct load_opts *opts)
+{
+	const char *loader = "image";
+	enum image_result r = IMAGE_NONE;
+
+	// for an image, opening it also adds its routes.
+	uint64_t start = startup_now();
+	if (map_self() == 0)
+		r = image_load(self_map, self_len);
+	startup_add(STARTUP_OPEN, start);
+
+	if (r == IMAGE_BAD || r == IMAGE_OOM) {
+		printf("load_routes: %s route image\n",
+			r == IMAGE_BAD ? "corrupt" : "OOM loading");
+		return 1;
+	}
+
+	if (r == IMAGE_NONE) {
+		loader = opts->lazy ? "lazy mapped zip" : "mapped zip";
+		if (!self_map || read_mapped_zip(opts) != 0) {
+			loader = "libarchive";
+			if (read_archive_for_routes() != 0)
+				return 1;
+		}
+	}
+
+	start = startup_now();
+	if (routes_seal() != 0) {
+		printf("load_routes: OOM or no 404 page\n");
+		return 1;
+	}
+	startup_add(STARTUP_TABLE, start);
+
+	printf("loaded %zu routes (%s), %zu bytes of route data\n",
+		routes.count, loader, routes.arena_len);
+
+	// an image comes with its copies compressed already. anything else
+	// is compressed in the background, once it's been rendered; lazy
+	// routes see to that themselves when they're filled.
+	if (r == IMAGE_NONE) {
+		for (size_t i = 0; i < routes.count; i++) {
+			const struct route *route = &routes.routes[i];
+			if (!route->alias && !route->variant_of
+					&& !route->fingerprint_of && route->body.ready)
+				compress_route(i);
+		}
+	}
+
+	return 0;
+}
@@ -0,0 +1,13 @@
+struct load_opts {
+	// threads used to inflate and render a zip archive. 0 means one per
+	// online cpu.
+	int threads;
+
+	// only index a zip archive at startup, and inflate and render each
+	// page the first time it's requested.
+	int lazy;
+};
+
+/* Load every route from whatever's appended to the executable, and seal the
+ * route store. Returns nonzero on failure, having said why. */
+int load_routes(const struct load_opts *);
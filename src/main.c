@@ -1,232 +1,512 @@
-#include <archive.h>
-#include <archive_entry.h>
+#include <errno.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdlib.h>
+#include <unistd.h>
 
 #include "mongoose.h"
 
-#include "markup.h"
+#include "load.h"
+#include "routes.h"
+#include "startup.h"
 
-#define MAX_ROUTES 1024
+static void respond(struct mg_connection *, struct mg_http_message *, int);
 
-struct response_body {
-	char *mime_type;
-	char *text;
+static int respond_range(struct mg_connection *, struct mg_http_message *,
+	const struct response_body *, int);
 
-	// a len < 0 indicates that text is null-terminated. otherwise, text is
-	// arbitrary data and may contain a null pointer. the allocation is len
-	// bytes long.
-	ssize_t len;
+static int send_head(struct mg_connection *, const char *, size_t, int);
 
-	int status;
+static void reply(struct mg_connection *, int, const char *);
+
+static void usage(void);
+
+struct serve_opts {
+	const char *port;
+
+	// event loops, each on its own thread. 0 means one per online cpu.
+	long threads;
+
+	// connections the kernel will queue on each listener before it starts
+	// dropping SYNs; it's capped by net.core.somaxconn.
+	int backlog;
+
+	// bytes a request's head may take. we only serve GETs, so that's all a
+	// connection ever buffers: bigger heads get a 431, bodies a 413.
+	size_t head_max;
+
+	// milliseconds a client gets to send a request's head, counted from
+	// its first byte (or from the accept); to sit idle between requests;
+	// and for a whole request, from its first byte until the response has
+	// gone out. past any of them the connection is closed.
+	uint64_t header_ms, idle_ms, request_ms;
+
+	// milliseconds responses under way get to finish after a SIGTERM or
+	// SIGINT; whatever hasn't gone out by then is cut off.
+	uint64_t drain_ms;
 };
 
-/* Do a bit of a static slab-allocation for routes. Also, we just do a linear
- * search each time we want to find a route. ouch, i know. */
-struct {
-	int counter;
-	struct {
-		char *route;
-		struct response_body body;
-	} routes[MAX_ROUTES];
-} routes = {
-	.counter = 0,
+/*
+ * where a connection is in its current request, kept in c->data.  mongoose
+ * parses before we see MG_EV_READ, so a whole request has already been
+ * answered by then; whatever is left in c->recv is the start of the next one.
+ */
+struct conn_state {
+	uint64_t started;	// first byte of the current request
+	int reading;		// its head hasn't all arrived yet
 };
 
-static void respond(struct mg_connection *, struct mg_http_message *);
+/* one serving thread's event loop, kept in its manager's userdata. */
+struct loop {
+	struct mg_mgr mgr;
+	const struct serve_opts *opts;
+	pthread_t thread;
+	int wake;		// write end of the pipe signals are relayed through
+	uint64_t drain_until;	// once draining, when it's cut short
+};
 
-static void die(const char *);
+/* all the loops, for the signal handler. */
+static struct loop *loops;
+static volatile sig_atomic_t nloops;
 
-static const struct response_body *
-get_route(const char *ref)
+/* set c's deadline, but while draining, never past the drain's own. */
+static void
+set_deadline(struct mg_connection *c, uint64_t when)
 {
-	int len = strlen(ref);
-	while (len > 0 && isspace(ref[len - 1]))
-		len--;
-
-	for (int i = 0; i < routes.counter; i++) {
-		const char *candidate = routes.routes[i].route;
+	struct loop *l = c->mgr->userdata;
+	if (l->drain_until && when > l->drain_until) when = l->drain_until;
+	mg_set_deadline(c, when);
+}
 
-		if (strlen(candidate) != len)
-			continue;
+static void
+begin_request(struct mg_connection *c, const struct serve_opts *opts)
+{
+	struct conn_state *st = (struct conn_state *) c->data;
+	st->started = mg_millis();
+	st->reading = 1;
+	set_deadline(c, st->started + opts->header_ms);
+}
 
-		if (strncmp(ref, candidate, len) == 0)
-			return &routes.routes[i].body;
+/* keep a slow or silent client from holding its connection and buffers. */
+static void
+track_deadlines(struct mg_connection *c, int ev, const struct serve_opts *opts)
+{
+	struct conn_state *st = (struct conn_state *) c->data;
+
+	switch (ev) {
+	case MG_EV_ACCEPT:
+		begin_request(c, opts);
+		break;
+	case MG_EV_READ:
+		if (!st->reading && c->recv.len > 0) begin_request(c, opts);
+		break;
+	case MG_EV_HTTP_MSG:
+		if (!st->reading) st->started = mg_millis();
+		st->reading = 0;
+		set_deadline(c, st->started + opts->request_ms);
+		break;
+	case MG_EV_WRITE:
+		if (!st->reading && c->send.len == 0 && c->sendq.len == 0)
+			set_deadline(c, mg_millis() + opts->idle_ms);
+		break;
 	}
-
-	return NULL;
 }
 
 static void
 hnd(struct mg_connection *c, int ev, void *ev_data, void *fn_data)
 {
+	track_deadlines(c, ev, fn_data);
 	if (ev != MG_EV_HTTP_MSG) return;
 
 	struct mg_http_message *hm = (struct mg_http_message *) ev_data;
 
-	if (mg_strcmp(hm->method, mg_str("GET")) != 0) {
-		mg_http_reply(c, 405, NULL, "");
+	// draining, and its last response is on the way: anything pipelined
+	// behind it goes unanswered.
+	if (c->is_draining) {
+		c->is_resp = 0;
+		return;
+	}
+
+	if (mg_strcmp(hm->method, mg_str("GET")) == 0) {
+		respond(c, hm, 0);
+	} else if (mg_strcmp(hm->method, mg_str("HEAD")) == 0) {
+		respond(c, hm, 1);
 	} else {
-		respond(c, hm);
+		reply(c, 405, "Allow: GET, HEAD\r\n");
 	}
 }
 
+/*
+ * queue part of a response, by reference if it lives as long as the process,
+ * or else by copy.  if it can't be queued, the response would come up short
+ * of its Content-Length and put the client out of step, so the connection is
+ * closed instead, and nonzero returned: send nothing more.
+ */
+static int
+send_part(struct mg_connection *c, const void *buf, size_t len, int ref)
+{
+	if (ref ? mg_send_ref(c, buf, len) : mg_send(c, buf, len))
+		return 0;
+	c->is_closing = 1;
+	return 1;
+}
+
+/*
+ * queue a response head, as send_part().  once the loop is draining, the
+ * head gets Connection: close, and the connection is closed as soon as the
+ * response is out.
+ */
+static int
+send_head(struct mg_connection *c, const char *head, size_t len, int ref)
+{
+	static const char last[] = "Connection: close\r\n\r\n";
+	struct loop *l = c->mgr->userdata;
+
+	if (!l->drain_until)
+		return send_part(c, head, len, ref);
+
+	// every head ends in a blank line; ours goes in before it.
+	if (send_part(c, head, len - 2, ref)
+			|| send_part(c, last, sizeof(last) - 1, 0))
+		return 1;
+	c->is_draining = 1;
+	return 0;
+}
+
+/* a bodiless reply with extra headers, as send_head() would send it. */
 static void
-respond(struct mg_connection *c, struct mg_http_message *hm)
+reply(struct mg_connection *c, int code, const char *headers)
 {
-	char *rqpath = strndup(hm->uri.ptr + (hm->uri.ptr[0] == '/'), hm->uri.len);
+	struct loop *l = c->mgr->userdata;
+	char h[128];
+	snprintf(h, sizeof(h), "%s%s", headers,
+		l->drain_until ? "Connection: close\r\n" : "");
+	mg_http_reply(c, code, h, "");
+	if (l->drain_until) c->is_draining = 1;
+}
 
-	const struct response_body *resp = get_route(rqpath);
-	if (!resp) {
-		mg_http_reply(
-			c, 404,
-			"Content-Type: text/html; charset=utf-8\r\n",
-			"%s", get_route("404")->text);
+/* Answer a GET, or a HEAD if head_only is set: exactly the same response, but
+ * without the body. */
+static void
+respond(struct mg_connection *c, struct mg_http_message *hm, int head_only)
+{
+	int skip = hm->uri.len > 0 && hm->uri.ptr[0] == '/';
+
+	const struct response_body *resp
+		= routes_get(hm->uri.ptr + skip, hm->uri.len - skip);
+	if (!resp)
+		resp = &routes.not_found;
 
-		goto cleanup;
+	// lazy routes are rendered on their first request.
+	resp = routes_ready(resp);
+	if (!resp) {
+		reply(c, 500, "");
+		return;
 	}
 
-	if (resp->len < 0) {
-		int clen = sizeof("Content-Type: \r\n") + strlen(resp->mime_type);
-		char *cbuf = malloc(clen);
-		strcpy(cbuf, "Content-Type: ");
-		strcat(cbuf, resp->mime_type);
-		strcat(cbuf, "\r\n");
+	// send a compressed copy, if there's one the client will take.
+	struct mg_str *accept = mg_http_get_header(hm, "Accept-Encoding");
+	resp = routes_negotiate(resp, accept ? accept->ptr : NULL,
+		accept ? accept->len : 0);
+
+	// the client may have this very representation cached already.
+	struct mg_str *inm = mg_http_get_header(hm, "If-None-Match");
+	struct mg_str *ims = mg_http_get_header(hm, "If-Modified-Since");
+	if (routes_fresh(resp, inm ? inm->ptr : NULL, inm ? inm->len : 0,
+			ims ? ims->ptr : NULL, ims ? ims->len : 0)) {
+		send_head(c, resp->not_modified, resp->not_modified_len, 1);
+		c->is_resp = 0;
+		return;
+	}
 
-		mg_http_reply(c, resp->status, cbuf, "%s", resp->text);
-		free(cbuf);
-	} else {
-		mg_printf(c,
-			"HTTP/1.1 200 OK\r\n"
-			"Transfer-Encoding: chunked\r\n"
-			"Content-Type: %s\r\n\n",
-			resp->mime_type);
-
-		mg_http_write_chunk(c, resp->text, resp->len);
-		mg_http_write_chunk(c, "", 0);
+	if (respond_range(c, hm, resp, head_only)) {
+		c->is_resp = 0;
+		return;
 	}
 
-cleanup:
-	free(rqpath);
+	// every route, text or binary, carries its pre-built response, with
+	// the right status and an exact Content-Length. route data lives as
+	// long as the process does, so queue a reference to it rather than
+	// copying it into the connection's send buffer.
+	if (send_head(c, resp->head, resp->head_len, 1) == 0 && !head_only)
+		send_part(c, resp->text, resp->len, 1);
+	c->is_resp = 0; // the response is complete; go on to the next one.
 }
 
-static void
-serve(void)
+/* The most ranges we'll answer in one response. */
+#define MAX_RANGES 8
+
+/* Answer a Range request for resp, if there's one to answer, leaving out the
+ * body if head_only is set. Returns nonzero if it did; otherwise, the whole
+ * response should be sent. */
+static int
+respond_range(struct mg_connection *c, struct mg_http_message *hm,
+	const struct response_body *resp, int head_only)
 {
-	struct mg_mgr mgr;
-	mg_mgr_init(&mgr);
+	struct mg_str *range = mg_http_get_header(hm, "Range");
+	if (!range) return 0;
+
+	// if the client's copy is stale, it gets the whole new one.
+	struct mg_str *if_range = mg_http_get_header(hm, "If-Range");
+	if (if_range && !routes_if_range(resp, if_range->ptr, if_range->len))
+		return 0;
+
+	struct byte_range ranges[MAX_RANGES];
+	int n = routes_ranges(resp, range->ptr, range->len, ranges, MAX_RANGES);
+	if (n < 0) return 0;
+
+	// heads are formatted per request, so they're copied into the send
+	// buffer; the ranges themselves are still sent from the route.
+	char head[512];
+	int len = n == 0
+		? routes_format_unsatisfiable(head, sizeof(head), resp)
+		: routes_format_partial(head, sizeof(head), resp, ranges, n);
+	if (len < 0) return 0;
+
+	// a 416 has no body at all.
+	if (send_head(c, head, len, 0) != 0 || head_only || n == 0)
+		return 1;
 
-	mg_http_listen(&mgr, "http://0.0.0.0:8080", hnd, NULL);
-	printf("listening on 0.0.0.0:8080\n");
+	if (n == 1) {
+		send_part(c, resp->text + ranges[0].first,
+			ranges[0].last - ranges[0].first + 1, 1);
+		return 1;
+	}
 
-	for (;;)
-		mg_mgr_poll(&mgr, 1000);
+	// the head is out already, so a part that won't format can only be
+	// answered by cutting the response short.
+	for (int i = 0; i <= n; i++) {
+		len = routes_format_part(head, sizeof(head), resp,
+			i < n ? &ranges[i] : NULL);
+		if (len < 0) {
+			c->is_closing = 1;
+			return 1;
+		}
+
+		if (send_part(c, head, len, 0) != 0)
+			return 1;
+		if (i < n && send_part(c, resp->text + ranges[i].first,
+				ranges[i].last - ranges[i].first + 1, 1) != 0)
+			return 1;
+	}
+
+	return 1;
 }
 
+/*
+ * stop taking connections and close the idle ones.  a response that's going
+ * out is the connection's last; a request that's partway in still gets its
+ * answer, with Connection: close.  either way, nothing outlasts drain_until.
+ */
 static void
-set_route(const char *route, const char *block, int64_t len)
-{
-	int index = routes.counter++;
-
-	if (index >= MAX_ROUTES)
-		return; // TODO: error out
-	
-	int is_css = strlen(route) > 4
-		&& strcmp(route + strlen(route) - 4, ".css") == 0;
-
-	int is_ttf = strlen(route) > 4
-		&& strcmp(route + strlen(route) - 4, ".ttf") == 0;
-
-	int is_png = strlen(route) > 4
-		&& strcmp(route + strlen(route) - 4, ".png") == 0;
-
-	int is_teapot = strcmp(route, "teapot") == 0;
-	
-	// for now, all routes return utf-8.
-	routes.routes[index].route = strdup(route);
-	routes.routes[index].body.status = is_teapot ? 418 : 200;
-	routes.routes[index].body.len = -1;
-	routes.routes[index].body.mime_type = is_css
-		? "text/css; charset=utf-8"
-		: is_ttf
-			? "font/ttf"
-			: is_png
-				? "image/png"
-				: "text/html; charset=utf-8";
-
-	// ttf is the only binary data type we have to deal with.
-	if (!is_ttf && !is_png) {
-		routes.routes[index].body.text = is_css
-			? strndup(block, len)
-			: render_markup(block, len);
-	} else {
-		char *dup = malloc(len);
-		memcpy(dup, block, len);
-		routes.routes[index].body.text = dup;
-		routes.routes[index].body.len = len;
+drain(struct loop *l)
+{
+	if (l->drain_until) return;
+	l->drain_until = mg_millis() + l->opts->drain_ms;
+
+	for (struct mg_connection *c = l->mgr.conns; c; c = c->next) {
+		if (!c->is_accepted) {
+			// the listener, and the pipe that brought us here.
+			c->is_closing = 1;
+		} else if (c->send.len > 0 || c->sendq.len > 0) {
+			c->is_draining = 1;
+			set_deadline(c, l->drain_until);
+		} else if (c->recv.len == 0) {
+			// nothing of a request yet: between two, or silent since
+			// the accept.
+			c->is_closing = 1;
+		} else {
+			set_deadline(c, c->deadline ? c->deadline : l->drain_until);
+		}
+		mg_set_ready(c);
 	}
+}
 
-	if (!routes.routes[index].body.text) {
-		die("set_route got null, likely OOM");
+/* a signal, relayed through the loop's pipe. */
+static void
+on_wake(struct mg_connection *c, int ev, void *ev_data, void *fn_data)
+{
+	if (ev == MG_EV_READ) {
+		c->recv.len = 0;
+		drain(fn_data);
 	}
-	
-	if (strcmp(route, "index") == 0) set_route("", block, len);
+	(void) ev_data;
 }
 
-static int
-read_zip_for_routes(void)
+/*
+ * a handler can't touch a manager, and may run on any thread, so it just
+ * wakes every loop up to drain itself.
+ */
+static void
+on_signal(int sig)
 {
-	int r;
+	int saved = errno;
+	for (long i = 0; i < nloops; i++)
+		send(loops[i].wake, "", 1, 0);
+	errno = saved;
+	(void) sig;
+}
 
-	struct archive *a = archive_read_new();
-	archive_read_support_filter_all(a);
-	archive_read_support_format_zip(a);
+static void *
+poll_loop(void *arg)
+{
+	struct loop *l = arg;
+	// no fixed tick: the wait ends at the next connection deadline.  after
+	// a drain the last connection to close ends the loop.
+	while (!l->drain_until || l->mgr.conns)
+		mg_mgr_poll(&l->mgr, -1);
+
+	// on this thread, so it takes this thread's spare buffers with it.
+	mg_mgr_free(&l->mgr);
+	return NULL;
+}
 
-	r = archive_read_open_filename(a, "/proc/self/exe", 10240);
-	if (r != ARCHIVE_OK) {
-		printf("read_zip_for_routes: archive_read_open_filename: %d\n", r);
-		return 1;
+/*
+ * every serving thread gets its own manager and its own listener on the same
+ * port (SO_REUSEPORT), so the kernel balances connections between them and
+ * the loops never share a connection.  the route table is read-only by now;
+ * lazy fills and background compression lock on their own.  the listeners are
+ * all opened here before any loop starts so a bind failure is reported once.
+ * serve returns once SIGTERM or SIGINT has drained every loop.
+ */
+static void
+serve(const struct serve_opts *opts)
+{
+	const char *port = opts->port;
+	char url[64];
+	snprintf(url, sizeof(url), "http://0.0.0.0:%s", port);
+
+	long nthreads = opts->threads;
+	if (nthreads <= 0) nthreads = sysconf(_SC_NPROCESSORS_ONLN);
+	if (nthreads <= 0) nthreads = 1;
+
+	uint64_t start = startup_now();
+	loops = calloc(nthreads, sizeof(*loops));
+	if (!loops) {
+		printf("out of memory\n");
+		exit(1);
 	}
 
-	struct archive_entry *aent;
-	for (;;) {
-		r = archive_read_next_header(a, &aent);
-
-		if (r == ARCHIVE_EOF) break;
-		if (r != ARCHIVE_OK) {
-			printf("read_zip_for_routes: archive_read_next_header: %d\n", r);
-			return 1;
+	for (long i = 0; i < nthreads; i++) {
+		struct loop *l = &loops[i];
+		l->opts = opts;
+		mg_mgr_init(&l->mgr);
+		l->mgr.userdata = l;
+		l->mgr.reuseport = nthreads > 1;
+		l->mgr.backlog = opts->backlog;
+		l->mgr.head_max = opts->head_max;
+
+		if (!mg_http_listen(&l->mgr, url, hnd, (void *) opts)) {
+			printf("can't listen on 0.0.0.0:%s\n", port);
+			exit(1);
 		}
+		if ((l->wake = mg_mkpipe(&l->mgr, on_wake, l, true)) < 0) {
+			printf("can't make a pipe\n");
+			exit(1);
+		}
+	}
 
-		const char *pathname = archive_entry_pathname(aent);
-		int64_t len = archive_entry_size(aent);
+	startup_add(STARTUP_LISTEN, start);
+	startup_report();
 
-		char *buf = malloc(len);
-		if (!buf) {
-			printf("read_zip_for_routes: OOM\n");
-			return 1;
-		}
+	// this thread serves too, so n loops means n - 1 more threads.
+	long started = 1;
+	for (; started < nthreads; started++) {
+		if (pthread_create(&loops[started].thread, NULL, poll_loop,
+				&loops[started]) != 0)
+			break;
+	}
 
-		archive_read_data(a, buf, len); // TODO: check for errs
-		set_route(pathname, buf, len);
-		free(buf);
+	// a listener without a loop would take its share of connections and
+	// never accept them.
+	for (long i = started; i < nthreads; i++) {
+		mg_mgr_free(&loops[i].mgr);
+		close(loops[i].wake);
 	}
 
-	archive_read_free(a);
-	return 0;
+	nloops = started;
+	struct sigaction sa = { .sa_handler = on_signal };
+	sigemptyset(&sa.sa_mask);
+	sa.sa_flags = SA_RESTART;
+	sigaction(SIGTERM, &sa, NULL);
+	sigaction(SIGINT, &sa, NULL);
+
+	printf("listening on 0.0.0.0:%s (%ld threads)\n", port, started);
+	poll_loop(&loops[0]);
+
+	for (long i = 1; i < started; i++)
+		pthread_join(loops[i].thread, NULL);
+
+	// the pipes' other ends went with their managers.  the handler
+	// mustn't write to these once they're closed.
+	nloops = 0;
+	for (long i = 0; i < started; i++)
+		close(loops[i].wake);
+	free(loops);
+	printf("drained, exiting\n");
 }
 
 static void
-die(const char *msg)
+usage(void)
 {
-	printf("%s\n", msg);
+	fprintf(stderr, "usage: srv [-l] [-j loader-threads] "
+		"[-t serving-threads] [-b backlog] [-H head-bytes] [-p port]\n");
 	exit(1);
 }
 
 int
 main(int argc, char **argv)
 {
-	if (read_zip_for_routes() != 0)
+	startup_begin();
+
+	// fly collects our stdout; don't sit on startup logs until exit.
+	setvbuf(stdout, NULL, _IOLBF, 0);
+
+	struct load_opts load_opts = { .threads = 0 };
+	struct serve_opts serve_opts = {
+		.port = "8080",
+		.threads = 0,
+		.backlog = SOMAXCONN,
+		.head_max = 16 * 1024,
+		.header_ms = 10 * 1000,
+		.idle_ms = 30 * 1000,
+		.request_ms = 60 * 1000,
+		// fly sends SIGKILL 5s after its stop signal, unless configured.
+		.drain_ms = 4 * 1000,
+	};
+
+	int opt;
+	while ((opt = getopt(argc, argv, "lj:t:b:H:p:")) != -1) {
+		switch (opt) {
+		case 'l':
+			load_opts.lazy = 1;
+			break;
+		case 'j':
+			load_opts.threads = atoi(optarg);
+			break;
+		case 't':
+			serve_opts.threads = atol(optarg);
+			break;
+		case 'b':
+			serve_opts.backlog = atoi(optarg);
+			break;
+		case 'H':
+			serve_opts.head_max = strtoul(optarg, NULL, 10);
+			break;
+		case 'p':
+			serve_opts.port = optarg;
+			break;
+		default:
+			usage();
+		}
+	}
+
+	if (optind != argc)
+		usage();
+
+	if (load_routes(&load_opts) != 0)
 		return 1;
 
-	serve();
+	serve(&serve_opts);
 	return 0;
 }
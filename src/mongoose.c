@@ -17,6 +17,10 @@
 //
 // SPDX-License-Identifier: GPL-2.0-only or commercial
 
+#if defined(__linux__) && !defined(_GNU_SOURCE)
+#define _GNU_SOURCE  // For accept4()
+#endif
+
 #include "mongoose.h"
 
 #ifdef MG_ENABLE_LINES
@@ -2271,6 +2275,19 @@ static void deliver_normal_chunks(struct mg_connection *c, size_t hlen,
   }
 }
 
+// Refuse a request without reading further: nothing more on this
+// connection is parsed, so it's closed once the reply is sent
+static void reject(struct mg_connection *c, int code, const char *reason) {
+  MG_DEBUG(("%lu %d %s, %lu bytes buffered", c->id, code, reason,
+            (unsigned long) c->recv.len));
+  mg_iobuf_free(&c->recv);
+  c->is_full = c->is_draining = 1;
+  mg_printf(c,
+            "HTTP/1.1 %d %s\r\nContent-Length: 0\r\n"
+            "Connection: close\r\n\r\n",
+            code, reason);
+}
+
 static void http_cb(struct mg_connection *c, int ev, void *evd, void *fnd) {
   if (ev == MG_EV_READ || ev == MG_EV_CLOSE) {
     struct mg_http_message hm;
@@ -2284,6 +2301,16 @@ static void http_cb(struct mg_connection *c, int ev, void *evd, void *fnd) {
       }
       if (c->is_resp) break;           // Response is still generated
       if (hlen == 0) break;            // Request is not buffered yet
+      if (c->is_accepted && c->mgr->head_max > 0) {
+        struct mg_str *cl = mg_http_get_header(&hm, "Content-Length");
+        if (mg_is_chunked(&hm) || (cl != NULL && hm.body.len > 0)) {
+          reject(c, 413, "Content Too Large");
+          break;
+        }
+        // Neither header: no body, whatever the method (RFC 9112 6.3)
+        hm.body.len = 0;
+        hm.message.len = (size_t) hlen;
+      }
       if (ev == MG_EV_CLOSE) {         // If client did not set Content-Length
         hm.message.len = c->recv.len;  // and closes now, deliver a MSG
         hm.body.len = hm.message.len - (size_t) (hm.body.ptr - hm.message.ptr);
@@ -2300,6 +2327,14 @@ static void http_cb(struct mg_connection *c, int ev, void *evd, void *fnd) {
       mg_call(c, MG_EV_HTTP_MSG, &hm);     // User handler can clear is_resp
       mg_iobuf_del(&c->recv, 0, hm.message.len);
     }
+    if (ev == MG_EV_READ && c->is_accepted && c->mgr->head_max > 0 &&
+        !c->is_draining) {
+      // Under a head budget, a request head that doesn't fit is refused,
+      // and one that waits behind an unfinished response stops reads
+      c->is_full = c->recv.len >= c->mgr->head_max;
+      if (c->is_full && !c->is_resp)
+        reject(c, 431, "Request Header Fields Too Large");
+    }
   }
   (void) evd, (void) fnd;
 }
@@ -2365,25 +2400,102 @@ static size_t roundup(size_t size, size_t align) {
   return align == 0 ? size : (size + align - 1) / align * align;
 }
 
+#if MG_ENABLE_IOBUF_POOL
+// Spare buffers of sizes MG_IO_SIZE << i, chained through their first bytes.
+// A manager is polled by one thread only, so each thread keeps its own pool
+// and buffers move between connections of that thread without locking
+struct mg_iobuf_pool {
+  void *spare[MG_IOBUF_POOL_CLASSES];
+  size_t count[MG_IOBUF_POOL_CLASSES];
+};
+static _Thread_local struct mg_iobuf_pool s_pool;
+
+static int poolclass(size_t size) {
+  int i;
+  for (i = 0; i < MG_IOBUF_POOL_CLASSES; i++) {
+    if (size <= ((size_t) MG_IO_SIZE << i)) return i;
+  }
+  return -1;
+}
+
+static size_t poolsize(size_t size) {
+  int i = poolclass(size);
+  return i < 0 ? size : (size_t) MG_IO_SIZE << i;
+}
+
+// Pooled memory is not zeroed: the iobuf API never exposes bytes past len
+static void *poolget(size_t size) {
+  int i = poolclass(size);
+  void *p;
+  if (i >= 0 && (p = s_pool.spare[i]) != NULL) {
+    memcpy(&s_pool.spare[i], p, sizeof(p));
+    s_pool.count[i]--;
+    return p;
+  }
+  return calloc(1, size);
+}
+
+static void poolput(void *buf, size_t size) {
+  int i = poolclass(size);
+  if (buf == NULL) return;
+  if (i >= 0 && size == ((size_t) MG_IO_SIZE << i) &&
+      (s_pool.count[i] + 1) * size <= MG_IOBUF_POOL_BYTES) {
+    memcpy(buf, &s_pool.spare[i], sizeof(buf));
+    s_pool.spare[i] = buf;
+    s_pool.count[i]++;
+  } else {
+    zeromem((unsigned char *) buf, size);  // Going back to the system
+    free(buf);
+  }
+}
+
+void mg_iobuf_pool_free(void) {
+  int i;
+  for (i = 0; i < MG_IOBUF_POOL_CLASSES; i++) {
+    void *p;
+    while ((p = s_pool.spare[i]) != NULL) {
+      memcpy(&s_pool.spare[i], p, sizeof(p));
+      zeromem((unsigned char *) p, (size_t) MG_IO_SIZE << i);
+      free(p);
+    }
+    s_pool.count[i] = 0;
+  }
+}
+#else
+static size_t poolsize(size_t size) {
+  return size;
+}
+
+static void *poolget(size_t size) {
+  return calloc(1, size);
+}
+
+static void poolput(void *buf, size_t size) {
+  zeromem((unsigned char *) buf, size);
+  free(buf);
+}
+
+void mg_iobuf_pool_free(void) {
+}
+#endif
+
 int mg_iobuf_resize(struct mg_iobuf *io, size_t new_size) {
   int ok = 1;
   new_size = roundup(new_size, io->align);
   if (new_size == 0) {
-    zeromem(io->buf, io->size);
-    free(io->buf);
+    poolput(io->buf, io->size);
     io->buf = NULL;
     io->len = io->size = 0;
-  } else if (new_size != io->size) {
+  } else if (poolsize(new_size) != io->size) {
     // NOTE(lsm): do not use realloc here. Use calloc/free only, to ease the
     // porting to some obscure platforms like FreeRTOS
-    void *p = calloc(1, new_size);
+    void *p = poolget(poolsize(new_size));
     if (p != NULL) {
       size_t len = new_size < io->len ? new_size : io->len;
       if (len > 0 && io->buf != NULL) memmove(p, io->buf, len);
-      zeromem(io->buf, io->size);
-      free(io->buf);
+      poolput(io->buf, io->size);
       io->buf = (unsigned char *) p;
-      io->size = new_size;
+      io->size = poolsize(new_size);
     } else {
       ok = 0;
       MG_ERROR(("%lld->%lld", (uint64_t) io->size, (uint64_t) new_size));
@@ -2402,11 +2514,14 @@ int mg_iobuf_init(struct mg_iobuf *io, size_t size, size_t align) {
 size_t mg_iobuf_add(struct mg_iobuf *io, size_t ofs, const void *buf,
                     size_t len) {
   size_t new_size = roundup(io->len + len, io->align);
-  mg_iobuf_resize(io, new_size);      // Attempt to resize
-  if (new_size != io->size) len = 0;  // Resize failure, append nothing
+  mg_iobuf_resize(io, new_size);     // Attempt to resize
+  if (new_size > io->size) len = 0;  // Resize failure, append nothing
   if (ofs < io->len) memmove(io->buf + ofs + len, io->buf + ofs, io->len - ofs);
   if (buf != NULL) memmove(io->buf + ofs, buf, len);
-  if (ofs > io->len) io->len += ofs - io->len;
+  if (ofs > io->len) {
+    memset(io->buf + io->len, 0, ofs - io->len);  // May be recycled memory
+    io->len += ofs - io->len;
+  }
   io->len += len;
   return len;
 }
@@ -2415,7 +2530,6 @@ size_t mg_iobuf_del(struct mg_iobuf *io, size_t ofs, size_t len) {
   if (ofs > io->len) ofs = io->len;
   if (ofs + len > io->len) len = io->len - ofs;
   if (io->buf) memmove(io->buf + ofs, io->buf + ofs + len, io->len - ofs - len);
-  if (io->buf) zeromem(io->buf + io->len - len, len);
   io->len -= len;
   return len;
 }
@@ -3557,9 +3671,26 @@ struct mg_connection *mg_mqtt_listen(struct mg_mgr *mgr, const char *url,
 
 
 
+// Queue c on mgr->ready, so the next mg_mgr_poll() visits it whether or not
+// its socket is ready, e.g. because it has new output to register interest
+// for. Only the epoll and io_uring loops use the list, the others visit
+// every connection on every pass. Call it after changing a connection from
+// outside its own event handler, e.g. setting is_closing
+void mg_set_ready(struct mg_connection *c) {
+#if MG_ENABLE_EPOLL
+  if (c->is_ready) return;
+  c->is_ready = 1;
+  c->next_ready = c->mgr->ready;
+  c->mgr->ready = c;
+#else
+  (void) c;
+#endif
+}
+
 size_t mg_vprintf(struct mg_connection *c, const char *fmt, va_list *ap) {
   size_t old = c->send.len;
   mg_vxprintf(mg_pfn_iobuf, &c->send, fmt, ap);
+  mg_set_ready(c);
   return c->send.len - old;
 }
 
@@ -3671,8 +3802,13 @@ bool mg_aton(struct mg_str str, struct mg_addr *addr) {
 }
 
 struct mg_connection *mg_alloc_conn(struct mg_mgr *mgr) {
-  struct mg_connection *c =
-      (struct mg_connection *) calloc(1, sizeof(*c) + mgr->extraconnsize);
+  struct mg_connection *c = mgr->spare;
+  if (c != NULL) {
+    mgr->spare = c->next, mgr->nspare--;
+    c->next = NULL;  // The rest was zeroed by mg_close_conn()
+  } else {
+    c = (struct mg_connection *) calloc(1, sizeof(*c) + mgr->extraconnsize);
+  }
   if (c != NULL) {
     c->mgr = mgr;
     c->send.align = c->recv.align = MG_IO_SIZE;
@@ -3684,6 +3820,12 @@ struct mg_connection *mg_alloc_conn(struct mg_mgr *mgr) {
 void mg_close_conn(struct mg_connection *c) {
   mg_resolve_cancel(c);  // Close any pending DNS query
   LIST_DELETE(struct mg_connection, &c->mgr->conns, c);
+  if (c->prev_timed != NULL) mg_set_deadline(c, 0);
+  if (c->is_ready) {
+    struct mg_connection **p = &c->mgr->ready;
+    while (*p != NULL && *p != c) p = &(*p)->next_ready;
+    if (*p != NULL) *p = c->next_ready;
+  }
   if (c == c->mgr->dns4.c) c->mgr->dns4.c = NULL;
   if (c == c->mgr->dns6.c) c->mgr->dns6.c = NULL;
   // Order of operations is important. `MG_EV_CLOSE` event must be fired
@@ -3694,10 +3836,23 @@ void mg_close_conn(struct mg_connection *c) {
   mg_tls_free(c);
   mg_iobuf_free(&c->recv);
   mg_iobuf_free(&c->send);
-  memset(c, 0, sizeof(*c));
-  free(c);
+  free(c->sendq.refs);
+  if (c->mgr->nspare < MG_CONN_SPARE) {
+    struct mg_mgr *mgr = c->mgr;
+    memset(c, 0, sizeof(*c) + mgr->extraconnsize);
+    c->next = mgr->spare, mgr->spare = c, mgr->nspare++;
+  } else {
+    memset(c, 0, sizeof(*c));
+    free(c);
+  }
 }
 
+#if !MG_ENABLE_SOCKET || !MG_ENABLE_SENDREF
+bool mg_send_ref(struct mg_connection *c, const void *buf, size_t len) {
+  return mg_send(c, buf, len);
+}
+#endif
+
 struct mg_connection *mg_connect(struct mg_mgr *mgr, const char *url,
                                  mg_event_handler_t fn, void *fn_data) {
   struct mg_connection *c = NULL;
@@ -3775,6 +3930,7 @@ void mg_mgr_free(struct mg_mgr *mgr) {
   while (t != NULL) tmp = t->next, free(t), t = tmp;
   mgr->timers = NULL;  // Important. Next call to poll won't touch timers
   for (c = mgr->conns; c != NULL; c = c->next) c->is_closing = 1;
+  mgr->sweep = 0;  // Visit every connection, so that all of them get closed
   mg_mgr_poll(mgr, 0);
 #if MG_ENABLE_FREERTOS_TCP
   FreeRTOS_DeleteSocketSet(mgr->ss);
@@ -3782,7 +3938,13 @@ void mg_mgr_free(struct mg_mgr *mgr) {
   MG_DEBUG(("All connections closed"));
 #if MG_ENABLE_EPOLL
   if (mgr->epoll_fd >= 0) close(mgr->epoll_fd), mgr->epoll_fd = -1;
+#if MG_ENABLE_IO_URING
+  mg_uring_free(mgr);
+#endif
 #endif
+  while ((c = mgr->spare) != NULL) mgr->spare = c->next, free(c);
+  mgr->nspare = 0;
+  mg_iobuf_pool_free();  // This thread's: free a manager where it was polled
   mg_tls_ctx_free(mgr);
 }
 
@@ -3790,6 +3952,9 @@ void mg_mgr_init(struct mg_mgr *mgr) {
   memset(mgr, 0, sizeof(*mgr));
 #if MG_ENABLE_EPOLL
   if ((mgr->epoll_fd = epoll_create1(0)) < 0) MG_ERROR(("epoll: %d", errno));
+#if MG_ENABLE_IO_URING
+  mg_uring_init(mgr);
+#endif
 #else
   mgr->epoll_fd = -1;
 #endif
@@ -4598,10 +4763,6 @@ static void iolog(struct mg_connection *c, char *buf, long n, bool r) {
       mg_call(c, MG_EV_READ, &n);
     } else {
       mg_iobuf_del(&c->send, 0, (size_t) n);
-      // if (c->send.len == 0) mg_iobuf_resize(&c->send, 0);
-      if (c->send.len == 0) {
-        MG_EPOLL_MOD(c, 0);
-      }
       mg_call(c, MG_EV_WRITE, &n);
     }
   }
@@ -4631,10 +4792,108 @@ bool mg_send(struct mg_connection *c, const void *buf, size_t len) {
     iolog(c, (char *) buf, n, false);
     return n > 0;
   } else {
+    mg_set_ready(c);
     return mg_iobuf_add(&c->send, c->send.len, buf, len);
   }
 }
 
+#if MG_ENABLE_SENDREF
+static bool mg_sendq_push(struct mg_sendq *q, const void *buf, size_t len) {
+  struct mg_sendref *last = q->len > 0 ? &q->refs[q->len - 1] : NULL;
+  if (buf != NULL && last != NULL && last->buf != NULL &&
+      (const char *) last->buf + last->len == buf) {
+    last->len += len;  // Contiguous with the previous reference, merge
+    return true;
+  }
+  if (q->len >= q->size) {
+    size_t size = q->size ? q->size * 2 : 8;
+    struct mg_sendref *refs =
+        (struct mg_sendref *) realloc(q->refs, size * sizeof(*refs));
+    if (refs == NULL) return false;
+    q->refs = refs, q->size = size;
+  }
+  q->refs[q->len].buf = buf;
+  q->refs[q->len].len = len;
+  q->len++;
+  if (buf == NULL) q->iolen += len;
+  return true;
+}
+
+// Queue len bytes at buf without copying them. The caller must keep buf
+// unchanged until the connection is closed. Bytes already in c->send go out
+// first, bytes added to c->send afterwards go out after this reference.
+bool mg_send_ref(struct mg_connection *c, const void *buf, size_t len) {
+  struct mg_sendq *q = &c->sendq;
+  if (c->is_udp || c->is_tls) return mg_send(c, buf, len);
+  if (len == 0) return true;
+  mg_set_ready(c);
+  if (c->send.len > q->iolen &&
+      !mg_sendq_push(q, NULL, c->send.len - q->iolen))
+    return false;
+  return mg_sendq_push(q, buf, len);
+}
+
+// Drop n sent bytes from the front of the queue. Bytes beyond the queued
+// segments came from the uncovered tail of c->send
+static void mg_sendq_consume(struct mg_connection *c, size_t n) {
+  struct mg_sendq *q = &c->sendq;
+  size_t i = 0, io = 0;
+  while (i < q->len && n > 0) {
+    struct mg_sendref *r = &q->refs[i];
+    size_t k = r->len < n ? r->len : n;
+    if (r->buf == NULL) {
+      io += k, q->iolen -= k;
+    } else {
+      r->buf = (const char *) r->buf + k;
+    }
+    r->len -= k, n -= k;
+    if (r->len == 0) i++;
+  }
+  if (i > 0) {
+    memmove(q->refs, q->refs + i, (q->len - i) * sizeof(q->refs[0]));
+    q->len -= i;
+  }
+  io += n;
+  if (io > 0) mg_iobuf_del(&c->send, 0, io);
+}
+
+static void write_sendq(struct mg_connection *c) {
+  struct mg_sendq *q = &c->sendq;
+  struct iovec iov[MG_SENDQ_IOV];
+  struct msghdr msg;
+  size_t i, n = 0, off = 0;
+  long sent;
+  for (i = 0; i < q->len && n < MG_SENDQ_IOV; i++, n++) {
+    if (q->refs[i].buf == NULL) {
+      iov[n].iov_base = c->send.buf + off;
+      off += q->refs[i].len;
+    } else {
+      iov[n].iov_base = (void *) q->refs[i].buf;
+    }
+    iov[n].iov_len = q->refs[i].len;
+  }
+  if (i == q->len && c->send.len > off && n < MG_SENDQ_IOV) {
+    iov[n].iov_base = c->send.buf + off;  // Uncovered tail of c->send
+    iov[n++].iov_len = c->send.len - off;
+  }
+  memset(&msg, 0, sizeof(msg));
+  msg.msg_iov = iov;
+  msg.msg_iovlen = n;
+  sent = sendmsg(FD(c), &msg, MSG_NONBLOCKING);
+  MG_DEBUG(("%lu %p sendq %ld/%ld rcv %ld/%ld n=%ld err=%d", c->id, c->fd,
+            (long) q->len, (long) c->send.len, (long) c->recv.len,
+            (long) c->recv.size, sent, MG_SOCK_ERR(sent)));
+  if (MG_SOCK_PENDING(sent)) {
+    // Do nothing
+  } else if (sent <= 0) {
+    c->is_closing = 1;
+  } else {
+    mg_sendq_consume(c, (size_t) sent);
+    mg_call(c, MG_EV_WRITE, &sent);
+  }
+}
+#endif
+
 static void mg_set_non_blocking_mode(MG_SOCKET_TYPE fd) {
 #if defined(MG_CUSTOM_NONBLOCK)
   MG_CUSTOM_NONBLOCK(fd);
@@ -4701,6 +4960,14 @@ bool mg_open_listener(struct mg_connection *c, const char *url) {
       // won't work! (setsockopt will return EINVAL)
       MG_ERROR(("setsockopt(SO_REUSEADDR): %d", MG_SOCK_ERR(rc)));
 #endif
+#if defined(SO_REUSEPORT)
+    } else if (c->mgr->reuseport &&
+               (rc = setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, (char *) &on,
+                                sizeof(on))) != 0) {
+      // Several managers, each on its own thread, listen on the same port
+      // and the kernel spreads new connections across them
+      MG_ERROR(("setsockopt(SO_REUSEPORT): %d", MG_SOCK_ERR(rc)));
+#endif
 #if defined(IPV6_V6ONLY)
     } else if (c->loc.is_ip6 &&
                (rc = setsockopt(fd, IPPROTO_IPV6, IPV6_V6ONLY, (char *) &on,
@@ -4711,7 +4978,9 @@ bool mg_open_listener(struct mg_connection *c, const char *url) {
     } else if ((rc = bind(fd, &usa.sa, slen)) != 0) {
       MG_ERROR(("bind: %d", MG_SOCK_ERR(rc)));
     } else if ((type == SOCK_STREAM &&
-                (rc = listen(fd, MG_SOCK_LISTEN_BACKLOG_SIZE)) != 0)) {
+                (rc = listen(fd, c->mgr->backlog > 0
+                                     ? c->mgr->backlog
+                                     : MG_SOCK_LISTEN_BACKLOG_SIZE)) != 0)) {
       // NOTE(lsm): FreeRTOS uses backlog value as a connection limit
       // In case port was set to 0, get the real port number
       MG_ERROR(("listen: %d", MG_SOCK_ERR(rc)));
@@ -4745,9 +5014,17 @@ long mg_io_recv(struct mg_connection *c, void *buf, size_t len) {
 
 // NOTE(lsm): do only one iteration of reads, cause some systems
 // (e.g. FreeRTOS stack) return 0 instead of -1/EWOULDBLOCK when no data
+// HTTP servers with a head budget buffer at most one request head
+static size_t recv_limit(const struct mg_connection *c) {
+  if (c->is_accepted && c->pfn == http_cb && c->mgr->head_max > 0)
+    return c->mgr->head_max;
+  return MG_MAX_RECV_SIZE;
+}
+
 static void read_conn(struct mg_connection *c) {
   long n = -1;
-  if (c->recv.len >= MG_MAX_RECV_SIZE) {
+  size_t limit = recv_limit(c);
+  if (c->recv.len >= limit) {
     mg_error(c, "max_recv_buf_size reached");
   } else if (c->recv.size <= c->recv.len &&
              !mg_iobuf_resize(&c->recv, c->recv.size + MG_IO_SIZE)) {
@@ -4755,6 +5032,7 @@ static void read_conn(struct mg_connection *c) {
   } else {
     char *buf = (char *) &c->recv.buf[c->recv.len];
     size_t len = c->recv.size - c->recv.len;
+    if (len > limit - c->recv.len) len = limit - c->recv.len;
     n = c->is_tls ? mg_tls_recv(c, buf, len) : mg_io_recv(c, buf, len);
     MG_DEBUG(("%lu %p snd %ld/%ld rcv %ld/%ld n=%ld err=%d", c->id, c->fd,
               (long) c->send.len, (long) c->send.size, (long) c->recv.len,
@@ -4766,17 +5044,235 @@ static void read_conn(struct mg_connection *c) {
 static void write_conn(struct mg_connection *c) {
   char *buf = (char *) c->send.buf;
   size_t len = c->send.len;
-  long n = c->is_tls ? mg_tls_send(c, buf, len) : mg_io_send(c, buf, len);
+  long n;
+#if MG_ENABLE_SENDREF
+  if (c->sendq.len > 0) {
+    write_sendq(c);
+    return;
+  }
+#endif
+  n = c->is_tls ? mg_tls_send(c, buf, len) : mg_io_send(c, buf, len);
   MG_DEBUG(("%lu %p snd %ld/%ld rcv %ld/%ld n=%ld err=%d", c->id, c->fd,
             (long) c->send.len, (long) c->send.size, (long) c->recv.len,
             (long) c->recv.size, n, MG_SOCK_ERR(n)));
   iolog(c, buf, n, false);
 }
 
+#if MG_ENABLE_EPOLL && MG_ENABLE_IO_URING
+// io_uring readiness backend. Every socket gets a one-shot IORING_OP_POLL_ADD
+// per direction, armed only while mongoose wants to read or write it, so the
+// interest changes and the wait go to the kernel in one io_uring_enter() per
+// mg_iotest() call, instead of an epoll_ctl() per writable connection.
+// One-shot polls are level-triggered: re-arming a socket that still has data
+// completes at once. If the ring can't be set up, the manager uses epoll.
+#define MG_URING_RD 1
+#define MG_URING_WR 2
+
+struct mg_uring_slot {
+  struct mg_connection *c;  // Connection that owns this fd, or NULL
+  uint32_t gen;             // Bumped whenever the fd changes owner
+  uint8_t armed;            // MG_URING_RD and MG_URING_WR polls in flight
+};
+
+struct mg_uring {
+  int fd;
+  unsigned entries;
+  unsigned *sq_head, *sq_tail, *sq_mask, *sq_array;
+  unsigned *cq_head, *cq_tail, *cq_mask;
+  struct io_uring_sqe *sqes;
+  struct io_uring_cqe *cqes;
+  void *sq_ring, *cq_ring;
+  size_t sq_ring_size, cq_ring_size;
+  struct mg_uring_slot *slots;  // Indexed by fd
+  size_t nslots;
+};
+
+// user_data of a poll: owner generation, fd and direction. Never 0, which
+// marks completions that need no attention, like those of POLL_REMOVE
+static uint64_t mg_uring_ud(uint32_t gen, int fd, unsigned dir) {
+  return ((uint64_t) gen << 32) | ((uint64_t) fd << 2) | dir;
+}
+
+static void mg_uring_release(struct mg_uring *u) {
+  if (u == NULL) return;
+  if (u->sqes != NULL)
+    munmap(u->sqes, u->entries * sizeof(struct io_uring_sqe));
+  if (u->cq_ring != NULL && u->cq_ring != u->sq_ring)
+    munmap(u->cq_ring, u->cq_ring_size);
+  if (u->sq_ring != NULL) munmap(u->sq_ring, u->sq_ring_size);
+  if (u->fd >= 0) close(u->fd);
+  free(u->slots);
+  free(u);
+}
+
+static void *mg_uring_map(int fd, size_t len, off_t off) {
+  void *p = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                 fd, off);
+  return p == MAP_FAILED ? NULL : p;
+}
+
+static struct mg_uring *mg_uring_open(void) {
+  struct mg_uring *u = (struct mg_uring *) calloc(1, sizeof(*u));
+  struct io_uring_params p;
+  if (u == NULL) return NULL;
+  memset(&p, 0, sizeof(p));
+  p.flags = IORING_SETUP_CLAMP | IORING_SETUP_COOP_TASKRUN;
+  u->fd = (int) syscall(__NR_io_uring_setup, MG_IO_URING_ENTRIES, &p);
+  if (u->fd < 0 && errno == EINVAL) {  // Pre-5.19 kernel, no COOP_TASKRUN
+    memset(&p, 0, sizeof(p));
+    p.flags = IORING_SETUP_CLAMP;
+    u->fd = (int) syscall(__NR_io_uring_setup, MG_IO_URING_ENTRIES, &p);
+  }
+  if (u->fd < 0) {
+    MG_INFO(("io_uring_setup: %d, falling back to epoll", errno));
+    free(u);
+    return NULL;
+  }
+  if (!(p.features & IORING_FEAT_EXT_ARG)) {  // Need it to wait with timeout
+    MG_INFO(("io_uring lacks EXT_ARG, falling back to epoll"));
+    mg_uring_release(u);
+    return NULL;
+  }
+  u->entries = p.sq_entries;
+  u->sq_ring_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+  u->cq_ring_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+  if (p.features & IORING_FEAT_SINGLE_MMAP) {
+    if (u->cq_ring_size > u->sq_ring_size) u->sq_ring_size = u->cq_ring_size;
+    u->cq_ring_size = u->sq_ring_size;
+  }
+  u->sq_ring = mg_uring_map(u->fd, u->sq_ring_size, IORING_OFF_SQ_RING);
+  u->cq_ring = p.features & IORING_FEAT_SINGLE_MMAP
+                   ? u->sq_ring
+                   : mg_uring_map(u->fd, u->cq_ring_size, IORING_OFF_CQ_RING);
+  u->sqes = (struct io_uring_sqe *) mg_uring_map(
+      u->fd, p.sq_entries * sizeof(struct io_uring_sqe), IORING_OFF_SQES);
+  if (u->sq_ring == NULL || u->cq_ring == NULL || u->sqes == NULL) {
+    MG_ERROR(("io_uring mmap: %d, falling back to epoll", errno));
+    mg_uring_release(u);
+    return NULL;
+  }
+  u->sq_head = (unsigned *) ((char *) u->sq_ring + p.sq_off.head);
+  u->sq_tail = (unsigned *) ((char *) u->sq_ring + p.sq_off.tail);
+  u->sq_mask = (unsigned *) ((char *) u->sq_ring + p.sq_off.ring_mask);
+  u->sq_array = (unsigned *) ((char *) u->sq_ring + p.sq_off.array);
+  u->cq_head = (unsigned *) ((char *) u->cq_ring + p.cq_off.head);
+  u->cq_tail = (unsigned *) ((char *) u->cq_ring + p.cq_off.tail);
+  u->cq_mask = (unsigned *) ((char *) u->cq_ring + p.cq_off.ring_mask);
+  u->cqes = (struct io_uring_cqe *) ((char *) u->cq_ring + p.cq_off.cqes);
+  MG_DEBUG(("io_uring fd %d, %u entries", u->fd, u->entries));
+  return u;
+}
+
+// Use a ring instead of epoll, if the kernel lets us
+bool mg_uring_init(struct mg_mgr *mgr) {
+  if ((mgr->uring = mg_uring_open()) == NULL) return false;
+  if (mgr->epoll_fd >= 0) close(mgr->epoll_fd), mgr->epoll_fd = -1;
+  return true;
+}
+
+void mg_uring_free(struct mg_mgr *mgr) {
+  mg_uring_release((struct mg_uring *) mgr->uring);
+  mgr->uring = NULL;
+}
+
+// Submit what's queued and, with ms != 0, wait up to ms for a completion
+static void mg_uring_enter(struct mg_uring *u, int ms) {
+  struct io_uring_getevents_arg arg;
+  struct __kernel_timespec ts;
+  unsigned flags = IORING_ENTER_GETEVENTS | IORING_ENTER_EXT_ARG;
+  unsigned pending = *u->sq_tail - __atomic_load_n(u->sq_head, __ATOMIC_ACQUIRE);
+  long rc;
+  memset(&arg, 0, sizeof(arg));
+  if (ms > 0) {
+    ts.tv_sec = ms / 1000;
+    ts.tv_nsec = (long long) (ms % 1000) * 1000000;
+    arg.ts = (uint64_t) (uintptr_t) &ts;
+  }
+  if (pending == 0 && ms == 0) return;
+  rc = syscall(__NR_io_uring_enter, u->fd, pending, ms == 0 ? 0 : 1,
+               ms == 0 ? 0 : flags, ms == 0 ? NULL : &arg,
+               ms == 0 ? 0 : sizeof(arg));
+  if (rc < 0 && errno != ETIME && errno != EINTR && errno != EBUSY)
+    MG_ERROR(("io_uring_enter: %d", errno));
+}
+
+// Queue an SQE. A full queue is handed to the kernel first
+static struct io_uring_sqe *mg_uring_sqe(struct mg_uring *u) {
+  unsigned tail = *u->sq_tail, i;
+  struct io_uring_sqe *sqe;
+  if (tail - __atomic_load_n(u->sq_head, __ATOMIC_ACQUIRE) >= u->entries) {
+    mg_uring_enter(u, 0);
+    if (tail - __atomic_load_n(u->sq_head, __ATOMIC_ACQUIRE) >= u->entries)
+      return NULL;
+  }
+  i = tail & *u->sq_mask;
+  sqe = &u->sqes[i];
+  memset(sqe, 0, sizeof(*sqe));
+  u->sq_array[i] = i;
+  return sqe;
+}
+
+static void mg_uring_push(struct mg_uring *u) {
+  __atomic_store_n(u->sq_tail, *u->sq_tail + 1, __ATOMIC_RELEASE);
+}
+
+static struct mg_uring_slot *mg_uring_slot(struct mg_uring *u, int fd) {
+  if ((size_t) fd >= u->nslots) {
+    size_t n = u->nslots ? u->nslots : 64;
+    struct mg_uring_slot *s;
+    while (n <= (size_t) fd) n *= 2;
+    s = (struct mg_uring_slot *) realloc(u->slots, n * sizeof(*s));
+    if (s == NULL) return NULL;
+    memset(s + u->nslots, 0, (n - u->nslots) * sizeof(*s));
+    u->slots = s, u->nslots = n;
+  }
+  return &u->slots[fd];
+}
+
+static void mg_uring_poll(struct mg_uring *u, struct mg_uring_slot *s, int fd,
+                          unsigned dir) {
+  struct io_uring_sqe *sqe = mg_uring_sqe(u);
+  if (sqe == NULL) return;  // Try again on the next mg_iotest()
+  sqe->opcode = IORING_OP_POLL_ADD;
+  sqe->fd = fd;
+  sqe->poll32_events =
+      (dir == MG_URING_RD ? POLLIN : POLLOUT) | POLLERR | POLLHUP;
+  sqe->user_data = mg_uring_ud(s->gen, fd, dir);
+  mg_uring_push(u);
+  s->armed |= (uint8_t) dir;
+}
+
+// Called before a socket is closed. A poll in flight holds a reference to
+// the socket, which would keep it open, so cancel it. Its completion then
+// carries a stale generation and is dropped
+static void mg_uring_forget(struct mg_connection *c) {
+  struct mg_uring *u = (struct mg_uring *) c->mgr->uring;
+  int fd = FD(c);
+  unsigned dir;
+  if (u == NULL || (size_t) fd >= u->nslots || u->slots[fd].c != c) return;
+  for (dir = MG_URING_RD; dir <= MG_URING_WR; dir <<= 1) {
+    struct io_uring_sqe *sqe;
+    if (!(u->slots[fd].armed & dir) || (sqe = mg_uring_sqe(u)) == NULL)
+      continue;
+    sqe->opcode = IORING_OP_POLL_REMOVE;
+    sqe->addr = mg_uring_ud(u->slots[fd].gen, fd, dir);
+    mg_uring_push(u);
+  }
+  u->slots[fd].c = NULL;
+  u->slots[fd].armed = 0;
+  u->slots[fd].gen++;
+}
+
+#endif
+
 static void close_conn(struct mg_connection *c) {
   if (FD(c) != MG_INVALID_SOCKET) {
 #if MG_ENABLE_EPOLL
-    epoll_ctl(c->mgr->epoll_fd, EPOLL_CTL_DEL, FD(c), NULL);
+    if (c->mgr->epoll_fd >= 0)
+      epoll_ctl(c->mgr->epoll_fd, EPOLL_CTL_DEL, FD(c), NULL);
+#if MG_ENABLE_IO_URING
+    mg_uring_forget(c);
+#endif
 #endif
     closesocket(FD(c));
 #if MG_ENABLE_FREERTOS_TCP
@@ -4793,7 +5289,6 @@ static void connect_conn(struct mg_connection *c) {
   if (getpeername(FD(c), &usa.sa, &n) == 0) {
     c->is_connecting = 0;
     mg_call(c, MG_EV_CONNECT, NULL);
-    MG_EPOLL_MOD(c, 0);
     if (c->is_tls_hs) mg_tls_handshake(c);
   } else {
     mg_error(c, "socket error");
@@ -4851,6 +5346,7 @@ void mg_connect_resolved(struct mg_connection *c) {
       mg_error(c, "connect: %d", MG_SOCK_ERR(rc));
     }
   }
+  mg_set_ready(c);  // Register interest in the connect, or close on error
 }
 
 static MG_SOCKET_TYPE raccept(MG_SOCKET_TYPE sock, union usa *usa,
@@ -4858,24 +5354,26 @@ static MG_SOCKET_TYPE raccept(MG_SOCKET_TYPE sock, union usa *usa,
   MG_SOCKET_TYPE fd = MG_INVALID_SOCKET;
   do {
     memset(usa, 0, sizeof(*usa));
+#if MG_ARCH == MG_ARCH_UNIX && defined(__linux__)
+    fd = accept4(sock, &usa->sa, len, SOCK_NONBLOCK | SOCK_CLOEXEC);
+#else
     fd = accept(sock, &usa->sa, len);
+#endif
   } while (MG_SOCK_INTR(fd));
   return fd;
 }
 
-static void accept_conn(struct mg_mgr *mgr, struct mg_connection *lsn) {
+// Returns false when the listener's queue is drained or accept failed
+static bool accept_conn(struct mg_mgr *mgr, struct mg_connection *lsn) {
   struct mg_connection *c = NULL;
   union usa usa;
   socklen_t sa_len = sizeof(usa);
   MG_SOCKET_TYPE fd = raccept(FD(lsn), &usa, &sa_len);
   if (fd == MG_INVALID_SOCKET) {
-#if MG_ARCH == MG_ARCH_AZURERTOS
-    // AzureRTOS, in non-block socket mode can mark listening socket readable
-    // even it is not. See comment for 'select' func implementation in
-    // nx_bsd.c That's not an error, just should try later
-    if (errno != EAGAIN)
-#endif
+    // The listener is non-blocking, so an empty queue is not an error
+    if (!MG_SOCK_PENDING(-1))
       MG_ERROR(("%lu accept failed, errno %d", lsn->id, MG_SOCK_ERR(-1)));
+    return false;
 #if (MG_ARCH != MG_ARCH_WIN32) && !MG_ENABLE_FREERTOS_TCP && \
     (MG_ARCH != MG_ARCH_TIRTOS) && !MG_ENABLE_POLL && !MG_ENABLE_EPOLL
   } else if ((long) fd >= FD_SETSIZE) {
@@ -4885,12 +5383,15 @@ static void accept_conn(struct mg_mgr *mgr, struct mg_connection *lsn) {
   } else if ((c = mg_alloc_conn(mgr)) == NULL) {
     MG_ERROR(("%lu OOM", lsn->id));
     closesocket(fd);
+    return false;
   } else {
     tomgaddr(&usa, &c->rem, sa_len != sizeof(usa.sin));
     LIST_ADD_HEAD(struct mg_connection, &mgr->conns, c);
     c->fd = S2PTR(fd);
     MG_EPOLL_ADD(c);
-    mg_set_non_blocking_mode(FD(c));
+#if !(MG_ARCH == MG_ARCH_UNIX && defined(__linux__))
+    mg_set_non_blocking_mode(FD(c));  // accept4() has done that already
+#endif
     setsockopts(c);
     c->is_accepted = 1;
     c->is_hexdumping = lsn->is_hexdumping;
@@ -4905,6 +5406,7 @@ static void accept_conn(struct mg_mgr *mgr, struct mg_connection *lsn) {
     mg_call(c, MG_EV_ACCEPT, NULL);
     if (lsn->is_tls) mg_tls_init(c, mg_str(""));
   }
+  return true;
 }
 
 static bool mg_socketpair(MG_SOCKET_TYPE sp[2], union usa usa[2], bool udp) {
@@ -4970,7 +5472,8 @@ static bool can_read(const struct mg_connection *c) {
 }
 
 static bool can_write(const struct mg_connection *c) {
-  return c->is_connecting || (c->send.len > 0 && c->is_tls_hs == 0);
+  return c->is_connecting ||
+         ((c->send.len > 0 || c->sendq.len > 0) && c->is_tls_hs == 0);
 }
 
 static bool skip_iotest(const struct mg_connection *c) {
@@ -4978,6 +5481,65 @@ static bool skip_iotest(const struct mg_connection *c) {
          (can_read(c) == false && can_write(c) == false);
 }
 
+#if MG_ENABLE_EPOLL && MG_ENABLE_IO_URING
+// Arm the polls that c wants and doesn't have in flight
+static void mg_uring_sync(struct mg_connection *c) {
+  struct mg_uring *u = (struct mg_uring *) c->mgr->uring;
+  struct mg_uring_slot *s = mg_uring_slot(u, FD(c));
+  if (s == NULL) return;
+  if (s->c != c) s->c = c, s->gen++, s->armed = 0;
+  if (can_read(c) && !(s->armed & MG_URING_RD))
+    mg_uring_poll(u, s, FD(c), MG_URING_RD);
+  if (can_write(c) && !(s->armed & MG_URING_WR))
+    mg_uring_poll(u, s, FD(c), MG_URING_WR);
+}
+
+static void mg_uring_iotest(struct mg_mgr *mgr, int ms) {
+  struct mg_uring *u = (struct mg_uring *) mgr->uring;
+  unsigned head, tail;
+  mg_uring_enter(u, ms);
+
+  head = *u->cq_head;
+  tail = __atomic_load_n(u->cq_tail, __ATOMIC_ACQUIRE);
+  for (; head != tail; head++) {
+    struct io_uring_cqe *cqe = &u->cqes[head & *u->cq_mask];
+    uint64_t ud = cqe->user_data;
+    int fd = (int) ((ud & 0xffffffffU) >> 2);
+    unsigned dir = (unsigned) (ud & 3);
+    struct mg_uring_slot *s = (size_t) fd < u->nslots ? &u->slots[fd] : NULL;
+    struct mg_connection *c;
+    if (ud == 0 || s == NULL || s->c == NULL || s->gen != (uint32_t) (ud >> 32))
+      continue;
+    c = s->c;
+    s->armed &= (uint8_t) ~dir;
+    mg_set_ready(c);             // Visit it, and re-arm afterwards
+    if (cqe->res < 0) continue;  // Cancelled
+    if (cqe->res & POLLERR) {
+      mg_error(c, "socket error");
+    } else if (dir == MG_URING_RD) {
+      if (cqe->res & (POLLIN | POLLHUP)) c->is_readable = can_read(c);
+    } else if (cqe->res & POLLOUT) {
+      c->is_writable = can_write(c);
+    }
+  }
+  __atomic_store_n(u->cq_head, head, __ATOMIC_RELEASE);
+}
+#endif
+
+#if MG_ENABLE_EPOLL
+// Bring the kernel's interest in c in line with what c wants. Cheap when
+// nothing changed: no syscall for epoll, no SQE for io_uring
+static void mg_io_sync(struct mg_connection *c) {
+#if MG_ENABLE_IO_URING
+  if (c->mgr->uring != NULL) {
+    mg_uring_sync(c);
+    return;
+  }
+#endif
+  if (can_write(c) != (bool) c->is_pollout) MG_EPOLL_MOD(c, can_write(c));
+}
+#endif
+
 static void mg_iotest(struct mg_mgr *mgr, int ms) {
 #if MG_ENABLE_FREERTOS_TCP
   struct mg_connection *c;
@@ -4998,17 +5560,26 @@ static void mg_iotest(struct mg_mgr *mgr, int ms) {
                       eSELECT_READ | eSELECT_EXCEPT | eSELECT_WRITE);
   }
 #elif MG_ENABLE_EPOLL
-  size_t max = 1;
-  for (struct mg_connection *c = mgr->conns; c != NULL; c = c->next) {
-    c->is_readable = c->is_writable = 0;
-    if (mg_tls_pending(c) > 0) ms = 1, c->is_readable = 1;
-    if (can_write(c)) MG_EPOLL_MOD(c, 1);
-    max++;
+  // Only connections on mgr->ready are looked at before the wait: those that
+  // were visited or given output since the last one. Interest in the rest
+  // is already registered. Whatever the wait returns joins mgr->ready
+  struct epoll_event evs[MG_EPOLL_EVENTS];
+  for (struct mg_connection *c = mgr->ready; c != NULL; c = c->next_ready) {
+    if (c->is_closing) ms = 0;  // Close it right away
+    if (skip_iotest(c)) continue;
+    if (mg_tls_pending(c) > 0) ms = 0, c->is_readable = 1;
+    mg_io_sync(c);
+  }
+#if MG_ENABLE_IO_URING
+  if (mgr->uring != NULL) {
+    mg_uring_iotest(mgr, ms);
+    return;
   }
-  struct epoll_event *evs = (struct epoll_event *) alloca(max * sizeof(evs[0]));
-  int n = epoll_wait(mgr->epoll_fd, evs, (int) max, ms);
+#endif
+  int n = epoll_wait(mgr->epoll_fd, evs, MG_EPOLL_EVENTS, ms);
   for (int i = 0; i < n; i++) {
     struct mg_connection *c = (struct mg_connection *) evs[i].data.ptr;
+    mg_set_ready(c);
     if (evs[i].events & EPOLLERR) {
       mg_error(c, "socket error");
     } else if (c->is_readable == 0) {
@@ -5018,7 +5589,6 @@ static void mg_iotest(struct mg_mgr *mgr, int ms) {
       c->is_writable = can_write(c) && wr ? 1U : 0;
     }
   }
-  (void) skip_iotest;
 #elif MG_ENABLE_POLL
   nfds_t n = 0;
   for (struct mg_connection *c = mgr->conns; c != NULL; c = c->next) n++;
@@ -5107,42 +5677,94 @@ static void mg_iotest(struct mg_mgr *mgr, int ms) {
 #endif
 }
 
+#if MG_ENABLE_IOBUF_POOL
+// Hand drained buffers back to the pool, so that an idle keep-alive
+// connection holds nothing but itself. The next read or send takes them
+// from the pool again, not from the heap
+static void release_idle(struct mg_connection *c) {
+  if (c->recv.len == 0) mg_iobuf_free(&c->recv);
+  if (c->send.len == 0 && c->sendq.len == 0) mg_iobuf_free(&c->send);
+}
+#endif
+
+static void poll_conn(struct mg_mgr *mgr, struct mg_connection *c,
+                      uint64_t now) {
+  bool is_resp = c->is_resp;
+  mg_call(c, MG_EV_POLL, &now);
+  if (is_resp && !c->is_resp) {
+    long n = 0;
+    mg_call(c, MG_EV_READ, &n);
+  }
+  MG_VERBOSE(("%lu %c%c %c%c%c%c%c", c->id, c->is_readable ? 'r' : '-',
+              c->is_writable ? 'w' : '-', c->is_tls ? 'T' : 't',
+              c->is_connecting ? 'C' : 'c', c->is_tls_hs ? 'H' : 'h',
+              c->is_resolving ? 'R' : 'r', c->is_closing ? 'C' : 'c'));
+  if (c->is_resolving || c->is_closing) {
+    // Do nothing
+  } else if (c->is_listening && c->is_udp == 0) {
+    // Drain a burst of connections in one go rather than one per poll,
+    // but bounded, so that established connections don't starve
+    int i;
+    for (i = 0; c->is_readable && i < MG_SOCK_ACCEPT_BATCH; i++) {
+      if (!accept_conn(mgr, c)) break;
+    }
+  } else if (c->is_connecting) {
+    if (c->is_readable || c->is_writable) connect_conn(c);
+  } else if (c->is_tls_hs) {
+    if ((c->is_readable || c->is_writable)) mg_tls_handshake(c);
+  } else {
+    if (c->is_readable) read_conn(c);
+    if (c->is_writable) write_conn(c);
+#if MG_ENABLE_IOBUF_POOL
+    release_idle(c);
+#endif
+  }
+
+  if (c->is_draining && c->send.len == 0 && c->sendq.len == 0)
+    c->is_closing = 1;
+}
+
 void mg_mgr_poll(struct mg_mgr *mgr, int ms) {
   struct mg_connection *c, *tmp;
   uint64_t now;
 
+  // Don't sleep through a connection deadline
+  if (mgr->wheel.count > 0)
+    ms = mg_wheel_timeout(&mgr->wheel, mg_millis(), ms);
   mg_iotest(mgr, ms);
   now = mg_millis();
   mg_timer_poll(&mgr->timers, now);
+  mg_wheel_poll(&mgr->wheel, now);
 
-  for (c = mgr->conns; c != NULL; c = tmp) {
-    bool is_resp = c->is_resp;
-    tmp = c->next;
-    mg_call(c, MG_EV_POLL, &now);
-    if (is_resp && !c->is_resp) {
-      long n = 0;
-      mg_call(c, MG_EV_READ, &n);
-    }
-    MG_VERBOSE(("%lu %c%c %c%c%c%c%c", c->id, c->is_readable ? 'r' : '-',
-                c->is_writable ? 'w' : '-', c->is_tls ? 'T' : 't',
-                c->is_connecting ? 'C' : 'c', c->is_tls_hs ? 'H' : 'h',
-                c->is_resolving ? 'R' : 'r', c->is_closing ? 'C' : 'c'));
-    if (c->is_resolving || c->is_closing) {
-      // Do nothing
-    } else if (c->is_listening && c->is_udp == 0) {
-      if (c->is_readable) accept_conn(mgr, c);
-    } else if (c->is_connecting) {
-      if (c->is_readable || c->is_writable) connect_conn(c);
-    } else if (c->is_tls_hs) {
-      if ((c->is_readable || c->is_writable)) mg_tls_handshake(c);
+#if MG_ENABLE_EPOLL
+  // Visit the connections on mgr->ready: those the wait returned, and those
+  // queued by mg_set_ready(). So a pass costs O(ready), not O(connections).
+  // Every MG_SWEEP_MS the rest get visited too, for their MG_EV_POLL
+  if (now >= mgr->sweep) {
+    for (c = mgr->conns; c != NULL; c = c->next) mg_set_ready(c);
+    mgr->sweep = now + MG_SWEEP_MS;
+  }
+  c = mgr->ready, mgr->ready = NULL;
+  for (; c != NULL; c = tmp) {
+    tmp = c->next_ready;
+    poll_conn(mgr, c, now);
+    c->is_ready = 0;
+    if (c->is_closing) {
+      close_conn(c);
     } else {
-      if (c->is_readable) read_conn(c);
-      if (c->is_writable) write_conn(c);
+      c->is_readable = c->is_writable = 0;
+      if (!skip_iotest(c)) mg_io_sync(c);
+      // A response still being generated wants MG_EV_POLL on every pass
+      if (c->is_resp || mg_tls_pending(c) > 0) mg_set_ready(c);
     }
-
-    if (c->is_draining && c->send.len == 0) c->is_closing = 1;
+  }
+#else
+  for (c = mgr->conns; c != NULL; c = tmp) {
+    tmp = c->next;
+    poll_conn(mgr, c, now);
     if (c->is_closing) close_conn(c);
   }
+#endif
 }
 #endif
 
@@ -5494,6 +6116,96 @@ void mg_timer_poll(struct mg_timer **head, uint64_t now_ms) {
   }
 }
 
+static void mg_wheel_unlink(struct mg_wheel *w, struct mg_connection *c) {
+  *c->prev_timed = c->next_timed;
+  if (c->next_timed != NULL) c->next_timed->prev_timed = c->prev_timed;
+  c->next_timed = NULL, c->prev_timed = NULL;
+  w->count--;
+}
+
+// File c by its deadline, but no earlier than tick `from`. The level is the
+// highest group of tick bits where the deadline differs from w->tick, so
+// its slot comes round before that level wraps
+static void mg_wheel_link(struct mg_wheel *w, struct mg_connection *c,
+                          uint64_t from) {
+  uint64_t t = c->deadline / MG_WHEEL_TICK_MS;
+  uint64_t max = w->tick | ((1ULL << (MG_WHEEL_BITS * MG_WHEEL_LEVELS)) - 1);
+  struct mg_connection **head;
+  unsigned level = 0;
+  if (t < from) t = from;
+  if (t > max) t = max;  // Too far ahead. Re-filed, and clamped, on the way
+  while (level + 1 < MG_WHEEL_LEVELS &&
+         ((t ^ w->tick) >> (MG_WHEEL_BITS * (level + 1))) != 0)
+    level++;
+  t = (t >> (MG_WHEEL_BITS * level)) & (MG_WHEEL_SLOTS - 1);
+  head = &w->slots[level][t];
+  c->next_timed = *head;
+  if (*head != NULL) (*head)->prev_timed = &c->next_timed;
+  c->prev_timed = head;
+  *head = c;
+  w->count++;
+}
+
+// Close c at mg_millis() time `when`, unless this is called again first.
+// 0 takes c off the wheel
+void mg_set_deadline(struct mg_connection *c, uint64_t when) {
+  struct mg_wheel *w = &c->mgr->wheel;
+  if (c->prev_timed != NULL) mg_wheel_unlink(w, c);
+  c->deadline = when;
+  if (when == 0) return;
+  if (w->count == 0) w->tick = mg_millis() / MG_WHEEL_TICK_MS;
+  mg_wheel_link(w, c, w->tick + 1);
+}
+
+// How long mg_mgr_poll() may wait without missing a tick that has work: the
+// next busy level 0 slot, or the end of this level 0 turn, when the slots
+// above get re-filed
+int mg_wheel_timeout(struct mg_wheel *w, uint64_t now, int ms) {
+  uint64_t t = w->tick + 1, at;
+  if (w->count == 0) return ms;
+  while ((t & (MG_WHEEL_SLOTS - 1)) != 0 &&
+         w->slots[0][t & (MG_WHEEL_SLOTS - 1)] == NULL)
+    t++;
+  at = t * MG_WHEEL_TICK_MS;
+  if (at <= now) return 0;
+  if (ms < 0 || at - now < (uint64_t) ms) return (int) (at - now);
+  return ms;
+}
+
+// Run every tick up to now: re-file the slots whose turn begins, then close
+// the connections in the tick's level 0 slot
+void mg_wheel_poll(struct mg_wheel *w, uint64_t now) {
+  uint64_t target = now / MG_WHEEL_TICK_MS;
+  if (w->count == 0) {
+    if (w->tick < target) w->tick = target;
+    return;
+  }
+  while (w->tick < target && w->count > 0) {
+    struct mg_connection *c, *next;
+    unsigned level;
+    w->tick++;
+    for (level = 1; level < MG_WHEEL_LEVELS; level++) {
+      uint64_t t = w->tick >> (MG_WHEEL_BITS * level);
+      struct mg_connection **head;
+      if ((w->tick & ((1ULL << (MG_WHEEL_BITS * level)) - 1)) != 0) break;
+      head = &w->slots[level][t & (MG_WHEEL_SLOTS - 1)];
+      for (c = *head; c != NULL; c = next) {
+        next = c->next_timed;
+        mg_wheel_unlink(w, c);
+        mg_wheel_link(w, c, w->tick);
+      }
+    }
+    while ((c = w->slots[0][w->tick & (MG_WHEEL_SLOTS - 1)]) != NULL) {
+      mg_wheel_unlink(w, c);
+      MG_DEBUG(("%lu deadline passed, closing", c->id));
+      c->deadline = 0;
+      c->is_closing = 1;
+      mg_set_ready(c);
+    }
+  }
+  if (w->tick < target) w->tick = target;
+}
+
 #ifdef MG_ENABLE_LINES
 #line 1 "src/tls_dummy.c"
 #endif
@@ -8721,6 +9433,7 @@ void mg_mgr_poll(struct mg_mgr *mgr, int ms) {
   uint64_t now = mg_millis();
   mg_tcpip_poll((struct mg_tcpip_if *) mgr->priv, now);
   mg_timer_poll(&mgr->timers, now);
+  mg_wheel_poll(&mgr->wheel, now);
   for (c = mgr->conns; c != NULL; c = tmp) {
     tmp = c->next;
     mg_call(c, MG_EV_POLL, &now);
@@ -377,6 +377,12 @@ static inline int mg_mkdir(const char *path, mode_t mode) {
 
 #if defined(MG_ENABLE_EPOLL) && MG_ENABLE_EPOLL
 #include <sys/epoll.h>
+#if defined(MG_ENABLE_IO_URING) && MG_ENABLE_IO_URING
+#include <linux/io_uring.h>
+#include <poll.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#endif
 #elif defined(MG_ENABLE_POLL) && MG_ENABLE_POLL
 #include <poll.h>
 #else
@@ -387,6 +393,7 @@ static inline int mg_mkdir(const char *path, mode_t mode) {
 #include <sys/stat.h>
 #include <sys/time.h>
 #include <sys/types.h>
+#include <sys/uio.h>
 #include <time.h>
 #include <unistd.h>
 
@@ -394,6 +401,14 @@ static inline int mg_mkdir(const char *path, mode_t mode) {
 #define MG_ENABLE_DIRLIST 1
 #endif
 
+#ifndef MG_ENABLE_SENDREF
+#define MG_ENABLE_SENDREF 1
+#endif
+
+#ifndef MG_ENABLE_IOBUF_POOL
+#define MG_ENABLE_IOBUF_POOL 1
+#endif
+
 #ifndef MG_PATH_MAX
 #define MG_PATH_MAX FILENAME_MAX
 #endif
@@ -697,6 +712,26 @@ struct timeval {
 #define MG_ENABLE_EPOLL 0
 #endif
 
+#ifndef MG_ENABLE_IO_URING
+#define MG_ENABLE_IO_URING 0  // Wait for sockets with io_uring, Linux only
+#endif
+
+#ifndef MG_IO_URING_ENTRIES
+#define MG_IO_URING_ENTRIES 1024  // Submission queue size
+#endif
+
+#ifndef MG_EPOLL_EVENTS
+#define MG_EPOLL_EVENTS 256  // Max events taken per epoll_wait()
+#endif
+
+#ifndef MG_SWEEP_MS
+#define MG_SWEEP_MS 1000  // Visit idle connections this often, 0: every poll
+#endif
+
+#ifndef MG_WHEEL_TICK_MS
+#define MG_WHEEL_TICK_MS 16  // Resolution of connection deadlines
+#endif
+
 #ifndef MG_ENABLE_FATFS
 #define MG_ENABLE_FATFS 0
 #endif
@@ -742,6 +777,22 @@ struct timeval {
 #define MG_IO_SIZE 2048  // Granularity of the send/recv IO buffer growth
 #endif
 
+#ifndef MG_ENABLE_IOBUF_POOL
+#define MG_ENABLE_IOBUF_POOL 0  // Recycle IO buffers, needs _Thread_local
+#endif
+
+#ifndef MG_IOBUF_POOL_CLASSES
+#define MG_IOBUF_POOL_CLASSES 6  // Pooled sizes: MG_IO_SIZE << 0..5
+#endif
+
+#ifndef MG_IOBUF_POOL_BYTES
+#define MG_IOBUF_POOL_BYTES (1024UL * 1024UL)  // Spare bytes per size class
+#endif
+
+#ifndef MG_CONN_SPARE
+#define MG_CONN_SPARE 256  // Closed connections kept for reuse, per manager
+#endif
+
 #ifndef MG_MAX_RECV_SIZE
 #define MG_MAX_RECV_SIZE (3UL * 1024UL * 1024UL)  // Maximum recv IO buffer size
 #endif
@@ -770,6 +821,18 @@ struct timeval {
 #define MG_SOCK_LISTEN_BACKLOG_SIZE 3
 #endif
 
+#ifndef MG_SOCK_ACCEPT_BATCH
+#define MG_SOCK_ACCEPT_BATCH 64  // Max connections accepted per poll
+#endif
+
+#ifndef MG_ENABLE_SENDREF
+#define MG_ENABLE_SENDREF 0  // Zero-copy mg_send_ref() via sendmsg()
+#endif
+
+#ifndef MG_SENDQ_IOV
+#define MG_SENDQ_IOV 64  // Max segments per sendmsg() call
+#endif
+
 #ifndef MG_DIRSEP
 #define MG_DIRSEP '/'
 #endif
@@ -795,16 +858,22 @@ struct timeval {
 #endif
 
 #if MG_ENABLE_EPOLL
-#define MG_EPOLL_ADD(c)                                                    \
-  do {                                                                     \
-    struct epoll_event ev = {EPOLLIN | EPOLLERR | EPOLLHUP, {c}};          \
-    epoll_ctl(c->mgr->epoll_fd, EPOLL_CTL_ADD, (int) (size_t) c->fd, &ev); \
+// With io_uring in use, epoll_fd is -1 and there's nothing to register:
+// the next poll arms the new socket's polls, because it's queued as ready
+#define MG_EPOLL_ADD(c)                                                      \
+  do {                                                                       \
+    struct epoll_event ev = {EPOLLIN | EPOLLERR | EPOLLHUP, {c}};            \
+    if (c->mgr->epoll_fd >= 0)                                               \
+      epoll_ctl(c->mgr->epoll_fd, EPOLL_CTL_ADD, (int) (size_t) c->fd, &ev); \
+    mg_set_ready(c);                                                         \
   } while (0)
-#define MG_EPOLL_MOD(c, wr)                                                \
-  do {                                                                     \
-    struct epoll_event ev = {EPOLLIN | EPOLLERR | EPOLLHUP, {c}};          \
-    if (wr) ev.events |= EPOLLOUT;                                         \
-    epoll_ctl(c->mgr->epoll_fd, EPOLL_CTL_MOD, (int) (size_t) c->fd, &ev); \
+#define MG_EPOLL_MOD(c, wr)                                                  \
+  do {                                                                       \
+    struct epoll_event ev = {EPOLLIN | EPOLLERR | EPOLLHUP, {c}};            \
+    if (wr) ev.events |= EPOLLOUT;                                           \
+    c->is_pollout = (wr) ? 1U : 0U;                                          \
+    if (c->mgr->epoll_fd >= 0)                                               \
+      epoll_ctl(c->mgr->epoll_fd, EPOLL_CTL_MOD, (int) (size_t) c->fd, &ev); \
   } while (0)
 #else
 #define MG_EPOLL_ADD(c)
@@ -957,6 +1026,23 @@ void mg_timer_free(struct mg_timer **head, struct mg_timer *);
 void mg_timer_poll(struct mg_timer **head, uint64_t new_ms);
 bool mg_timer_expired(uint64_t *expiration, uint64_t period, uint64_t now);
 
+// Hierarchical timer wheel holding connection deadlines, see mg_set_deadline().
+// Level 0 has a slot per tick; each level up, a slot spans a whole turn of
+// the level below and is re-filed into it when that turn begins
+#define MG_WHEEL_BITS 6  // Slots per level, log2
+#define MG_WHEEL_SLOTS (1U << MG_WHEEL_BITS)
+#define MG_WHEEL_LEVELS 4  // With 16 ms ticks, reaches over 74 hours ahead
+
+struct mg_connection;
+struct mg_wheel {
+  struct mg_connection *slots[MG_WHEEL_LEVELS][MG_WHEEL_SLOTS];
+  uint64_t tick;  // Last tick that has been run
+  size_t count;   // Connections on the wheel
+};
+
+void mg_wheel_poll(struct mg_wheel *, uint64_t now);
+int mg_wheel_timeout(struct mg_wheel *, uint64_t now, int ms);
+
 
 
 
@@ -1076,6 +1162,7 @@ struct mg_iobuf {
 int mg_iobuf_init(struct mg_iobuf *, size_t, size_t);
 int mg_iobuf_resize(struct mg_iobuf *, size_t);
 void mg_iobuf_free(struct mg_iobuf *);
+void mg_iobuf_pool_free(void);  // Release spare buffers of this thread
 size_t mg_iobuf_add(struct mg_iobuf *, size_t, const void *, size_t);
 size_t mg_iobuf_del(struct mg_iobuf *, size_t ofs, size_t len);
 
@@ -1173,13 +1260,35 @@ struct mg_mgr {
   void *active_dns_requests;    // DNS requests in progress
   struct mg_timer *timers;      // Active timers
   int epoll_fd;                 // Used when MG_EPOLL_ENABLE=1
+  void *uring;                  // Used when MG_ENABLE_IO_URING=1
   void *priv;                   // Used by the MIP stack
   size_t extraconnsize;         // Used by the MIP stack
+  struct mg_connection *ready;  // Connections for the next poll, epoll only
+  uint64_t sweep;               // When the next poll visits all connections
+  struct mg_wheel wheel;        // Connection deadlines
+  bool reuseport;               // Listeners may share a port, SO_REUSEPORT
+  int backlog;                  // listen() backlog, 0: default
+  size_t head_max;  // HTTP servers: max request head, no bodies. 0: unbounded
+  struct mg_connection *spare;  // Closed connections, for mg_alloc_conn()
+  size_t nspare;                // Number of spare connections
 #if MG_ENABLE_FREERTOS_TCP
   SocketSet_t ss;  // NOTE(lsm): referenced from socket struct
 #endif
 };
 
+// A reference to data owned by the caller, queued by mg_send_ref()
+struct mg_sendref {
+  const void *buf;  // Data to send, or NULL for the next len bytes of c->send
+  size_t len;       // Bytes still to send
+};
+
+struct mg_sendq {
+  struct mg_sendref *refs;  // Segments, in the order they go out
+  size_t len;               // Number of queued segments
+  size_t size;              // Number of allocated segments
+  size_t iolen;             // Bytes of c->send covered by NULL segments
+};
+
 struct mg_connection {
   struct mg_connection *next;  // Linkage in struct mg_mgr :: connections
   struct mg_mgr *mgr;          // Our container
@@ -1189,6 +1298,7 @@ struct mg_connection {
   unsigned long id;            // Auto-incrementing unique connection ID
   struct mg_iobuf recv;        // Incoming data
   struct mg_iobuf send;        // Outgoing data
+  struct mg_sendq sendq;       // Zero-copy outgoing data, see mg_send_ref()
   mg_event_handler_t fn;       // User-specified event handler function
   void *fn_data;               // User-specified function parameter
   mg_event_handler_t pfn;      // Protocol-specific handler function
@@ -1213,11 +1323,20 @@ struct mg_connection {
   unsigned is_resp : 1;        // Response is still being generated
   unsigned is_readable : 1;    // Connection is ready to read
   unsigned is_writable : 1;    // Connection is ready to write
+  unsigned is_ready : 1;       // Queued on mgr->ready for the next poll
+  unsigned is_pollout : 1;     // EPOLLOUT is registered, see MG_EPOLL_MOD
+
+  struct mg_connection *next_ready;  // Linkage in struct mg_mgr :: ready
+  struct mg_connection *next_timed;  // Linkage in struct mg_mgr :: wheel
+  struct mg_connection **prev_timed;  // What points at us on the wheel
+  uint64_t deadline;                  // See mg_set_deadline()
 };
 
 void mg_mgr_poll(struct mg_mgr *, int ms);
 void mg_mgr_init(struct mg_mgr *);
 void mg_mgr_free(struct mg_mgr *);
+void mg_set_deadline(struct mg_connection *, uint64_t when);
+void mg_set_ready(struct mg_connection *);  // Visit on the next poll
 
 struct mg_connection *mg_listen(struct mg_mgr *, const char *url,
                                 mg_event_handler_t fn, void *fn_data);
@@ -1227,6 +1346,7 @@ struct mg_connection *mg_wrapfd(struct mg_mgr *mgr, int fd,
                                 mg_event_handler_t fn, void *fn_data);
 void mg_connect_resolved(struct mg_connection *);
 bool mg_send(struct mg_connection *, const void *, size_t);
+bool mg_send_ref(struct mg_connection *, const void *, size_t);
 size_t mg_printf(struct mg_connection *, const char *fmt, ...);
 size_t mg_vprintf(struct mg_connection *, const char *fmt, va_list *ap);
 bool mg_aton(struct mg_str str, struct mg_addr *addr);
@@ -1237,6 +1357,12 @@ struct mg_connection *mg_alloc_conn(struct mg_mgr *);
 void mg_close_conn(struct mg_connection *c);
 bool mg_open_listener(struct mg_connection *c, const char *url);
 
+#if MG_ENABLE_EPOLL && MG_ENABLE_IO_URING
+// Called by mg_mgr_init() and mg_mgr_free(), see MG_ENABLE_IO_URING
+bool mg_uring_init(struct mg_mgr *);
+void mg_uring_free(struct mg_mgr *);
+#endif
+
 // Utility functions
 struct mg_timer *mg_timer_add(struct mg_mgr *mgr, uint64_t milliseconds,
                               unsigned flags, void (*fn)(void *), void *arg);
@@ -0,0 +1,945 @@
+#include <ctype.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+
+#include "assets.h"
+#include "routes.h"
+
+struct route_store routes;
+
+/* Room for any head we format, and for the headers shared between them. */
+#define HEAD_MAX 512
+#define SHARED_MAX 256
+
+/* 32-bit FNV-1a. it's not fancy, but route names are short and it spreads them
+ * well enough for a half-empty table. */
+static uint32_t
+hash_route(const char *s, size_t len)
+{
+	uint32_t h = 2166136261u;
+	for (size_t i = 0; i < len; i++) {
+		h ^= (unsigned char) s[i];
+		h *= 16777619u;
+	}
+
+	return h;
+}
+
+uint64_t
+routes_hash(const void *data, size_t len)
+{
+	const unsigned char *p = data;
+	uint64_t h = 14695981039346656037ull;
+	for (size_t i = 0; i < len; i++) {
+		h ^= p[i];
+		h *= 1099511628211ull;
+	}
+
+	return h;
+}
+
+/* Reserve len bytes at the end of the arena, 16-byte aligned, and return their
+ * offset. Returns (size_t) -1 on OOM. */
+static size_t
+arena_alloc(size_t len)
+{
+	size_t off = (routes.arena_len + 15) & ~(size_t) 15;
+
+	if (off + len > routes.arena_cap) {
+		size_t cap = routes.arena_cap ? routes.arena_cap : 65536;
+		while (cap < off + len)
+			cap *= 2;
+
+		char *arena = realloc(routes.arena, cap);
+		if (!arena) return (size_t) -1;
+
+		routes.arena = arena;
+		routes.arena_cap = cap;
+	}
+
+	routes.arena_len = off + len;
+	return off;
+}
+
+static size_t
+arena_push(const void *data, size_t len)
+{
+	size_t off = arena_alloc(len);
+	if (off != (size_t) -1)
+		memcpy(routes.arena + off, data, len);
+
+	return off;
+}
+
+int
+routes_classify(const char *route, const char **mime_type, int *status)
+{
+	int is_css = strlen(route) > 4
+		&& strcmp(route + strlen(route) - 4, ".css") == 0;
+
+	int is_ttf = strlen(route) > 4
+		&& strcmp(route + strlen(route) - 4, ".ttf") == 0;
+
+	int is_png = strlen(route) > 4
+		&& strcmp(route + strlen(route) - 4, ".png") == 0;
+
+	int is_teapot = strcmp(route, "teapot") == 0;
+
+	// for now, all routes return utf-8.
+	*status = is_teapot ? 418 : 200;
+	*mime_type = is_css
+		? "text/css; charset=utf-8"
+		: is_ttf
+			? "font/ttf"
+			: is_png
+				? "image/png"
+				: "text/html; charset=utf-8";
+
+	return !is_css && !is_ttf && !is_png;
+}
+
+int
+routes_compressible(const char *mime_type)
+{
+	// png is compressed already; everything else we serve is text or ttf.
+	return strncmp(mime_type, "text/", 5) == 0
+		|| strcmp(mime_type, "font/ttf") == 0;
+}
+
+const char *
+routes_encoding_name(enum route_encoding encoding)
+{
+	switch (encoding) {
+	case ENCODING_BR: return "br";
+	case ENCODING_ZSTD: return "zstd";
+	case ENCODING_GZIP: return "gzip";
+	default: return NULL;
+	}
+}
+
+static const char *
+status_text(int status)
+{
+	switch (status) {
+	case 200: return "OK";
+	case 404: return "Not Found";
+	case 418: return "I'm a teapot";
+	default: return "OK";
+	}
+}
+
+/* Format body's ETag, quotes and all. Compressed copies are different
+ * representations, so they get their own. */
+static void
+format_etag(char *etag, size_t size, const struct response_body *body)
+{
+	snprintf(etag, size, "\"%016llx%s%s\"", (unsigned long long) body->hash,
+		body->encoding ? "-" : "", body->encoding ? body->encoding : "");
+}
+
+/* Format the headers that go in both a full response and a 304: the
+ * validators, for 200s, and Vary. */
+static void
+format_shared(char *out, size_t size, const struct response_body *body)
+{
+	char etag[48], date[40] = "";
+	format_etag(etag, sizeof(etag), body);
+
+	struct tm tm;
+	if (body->mtime && gmtime_r(&body->mtime, &tm))
+		strftime(date, sizeof(date), "%a, %d %b %Y %H:%M:%S GMT", &tm);
+
+	int ok = body->status == 200;
+	snprintf(out, size, "%s%s%s%s%s%s%s%s",
+		ok ? "ETag: " : "", ok ? etag : "", ok ? "\r\n" : "",
+		ok && *date ? "Last-Modified: " : "", ok ? date : "",
+		ok && *date ? "\r\n" : "",
+		ok && body->immutable ? ASSETS_CACHE_CONTROL : "",
+		routes_compressible(body->mime_type) ? "Vary: Accept-Encoding\r\n" : "");
+}
+
+/* Format the status line and headers for body, whose status, mime type,
+ * length and validators must be set, into head. Returns the length, or -1 if
+ * it won't fit. */
+static int
+format_head(char *head, size_t size, const struct response_body *body)
+{
+	char shared[SHARED_MAX];
+	format_shared(shared, sizeof(shared), body);
+
+	int head_len = snprintf(head, size,
+		"HTTP/1.1 %d %s\r\n"
+		"Content-Type: %s\r\n"
+		"%s%s%s"
+		"%s"
+		"%s"
+		"Content-Length: %zu\r\n"
+		"\r\n",
+		body->status, status_text(body->status), body->mime_type,
+		body->encoding ? "Content-Encoding: " : "",
+		body->encoding ? body->encoding : "",
+		body->encoding ? "\r\n" : "",
+		shared, body->status == 200 ? "Accept-Ranges: bytes\r\n" : "",
+		body->len);
+
+	return head_len < 0 || head_len >= (int) size ? -1 : head_len;
+}
+
+/* Format body's 304 into head, as format_head. Returns 0, formatting nothing,
+ * if body isn't a 200. */
+static int
+format_not_modified(char *head, size_t size, const struct response_body *body)
+{
+	if (body->status != 200) return 0;
+
+	char shared[SHARED_MAX];
+	format_shared(shared, sizeof(shared), body);
+
+	int head_len = snprintf(head, size,
+		"HTTP/1.1 304 Not Modified\r\n"
+		"%s"
+		"\r\n",
+		shared);
+
+	return head_len < 0 || head_len >= (int) size ? -1 : head_len;
+}
+
+/* Write the 304 for body, if it gets one, into the arena. Returns its offset,
+ * or (size_t) -1 on failure. */
+static size_t
+arena_push_not_modified(struct response_body *body)
+{
+	char head[HEAD_MAX];
+	int head_len = format_not_modified(head, sizeof(head), body);
+	if (head_len < 0)
+		return (size_t) -1;
+
+	body->not_modified_len = head_len;
+	return arena_push(head, head_len);
+}
+
+/* Write the head for body into the arena, leaving room for extra bytes right
+ * behind it. Returns the offset of the head, or (size_t) -1 on failure. */
+static size_t
+arena_push_head(struct response_body *body, size_t extra)
+{
+	char head[HEAD_MAX];
+	int head_len = format_head(head, sizeof(head), body);
+	if (head_len < 0)
+		return (size_t) -1;
+
+	size_t off = arena_alloc(head_len + extra);
+	if (off == (size_t) -1) return off;
+
+	memcpy(routes.arena + off, head, head_len);
+	body->head_len = head_len;
+	return off;
+}
+
+/* Copy the heads for body out of the arena's way, into the heap, for bodies
+ * filled in after the store is sealed. Returns nonzero on OOM. */
+static int
+alloc_heads(struct response_body *body)
+{
+	char buf[HEAD_MAX], nm[HEAD_MAX];
+	int head_len = format_head(buf, sizeof(buf), body);
+	int nm_len = format_not_modified(nm, sizeof(nm), body);
+	if (head_len < 0 || nm_len < 0) return 1;
+
+	char *head = malloc(head_len + nm_len);
+	if (!head) return 1;
+
+	memcpy(head, buf, head_len);
+	memcpy(head + head_len, nm, nm_len);
+	body->head = head;
+	body->head_len = head_len;
+	body->not_modified = nm_len ? head + head_len : NULL;
+	body->not_modified_len = nm_len;
+	return 0;
+}
+
+static struct route *
+route_new(const char *key, const char *mime_type, int status, time_t mtime)
+{
+	if (routes.count == routes.cap) {
+		size_t cap = routes.cap ? routes.cap * 2 : 64;
+		struct route *grown = realloc(routes.routes, cap * sizeof(*grown));
+		if (!grown) return NULL;
+
+		routes.routes = grown;
+		routes.cap = cap;
+	}
+
+	struct route *r = &routes.routes[routes.count];
+	memset(r, 0, sizeof(*r));
+	r->body.mime_type = mime_type;
+	r->body.status = status;
+	r->body.mtime = mtime;
+	r->body.ready = 1;
+
+	r->route_len = strlen(key);
+	r->route_off = arena_push(key, r->route_len + 1);
+	if (r->route_off == (size_t) -1) return NULL;
+
+	routes.count++;
+	return r;
+}
+
+ssize_t
+routes_add(const char *key, const char *mime_type, int status,
+	const char *body, ssize_t len, time_t mtime)
+{
+	struct route *r = route_new(key, mime_type, status, mtime);
+	if (!r) return -1;
+
+	// text bodies keep their terminator in the arena, though it isn't
+	// part of the response.
+	int nul = len < 0;
+	r->body.len = nul ? strlen(body) : (size_t) len;
+	r->body.hash = routes_hash(body, r->body.len);
+
+	r->not_modified_off = arena_push_not_modified(&r->body);
+	if (r->not_modified_off == (size_t) -1) return -1;
+
+	r->head_off = arena_push_head(&r->body, r->body.len + nul);
+	if (r->head_off == (size_t) -1) return -1;
+
+	r->text_off = r->head_off + r->body.head_len;
+	memcpy(routes.arena + r->text_off, body, r->body.len + nul);
+
+	return routes.count - 1;
+}
+
+ssize_t
+routes_add_ref(const char *key, const char *mime_type, int status,
+	const char *body, size_t len, time_t mtime, uint64_t hash)
+{
+	struct route *r = route_new(key, mime_type, status, mtime);
+	if (!r) return -1;
+
+	r->body.len = len;
+	r->body.hash = hash;
+	r->ext = body;
+
+	r->not_modified_off = arena_push_not_modified(&r->body);
+	if (r->not_modified_off == (size_t) -1) return -1;
+
+	r->head_off = arena_push_head(&r->body, 0);
+	if (r->head_off == (size_t) -1) return -1;
+
+	return routes.count - 1;
+}
+
+ssize_t
+routes_add_lazy(const char *key, const char *mime_type, int status,
+	char *(*fill)(void *, size_t *), void *arg, time_t mtime)
+{
+	struct route *r = route_new(key, mime_type, status, mtime);
+	if (!r) return -1;
+
+	r->body.ready = 0;
+	r->body.fill = fill;
+	r->body.arg = arg;
+
+	return routes.count - 1;
+}
+
+ssize_t
+routes_add_encoded(size_t index, enum route_encoding encoding,
+	const char *body, size_t len)
+{
+	const struct route orig = routes.routes[index];
+
+	// copies are only reached through the original, so the name is
+	// never looked at.
+	struct route *r = route_new("", orig.body.mime_type, orig.body.status,
+		orig.body.mtime);
+	if (!r) return -1;
+
+	r->variant_of = index + 1;
+	r->encoding = encoding;
+	r->body.encoding = routes_encoding_name(encoding);
+	r->body.len = len;
+	r->body.hash = orig.body.hash;
+	r->body.immutable = orig.body.immutable;
+	r->ext = body;
+
+	r->not_modified_off = arena_push_not_modified(&r->body);
+	if (r->not_modified_off == (size_t) -1) return -1;
+
+	r->head_off = arena_push_head(&r->body, 0);
+	if (r->head_off == (size_t) -1) return -1;
+
+	return routes.count - 1;
+}
+
+ssize_t
+routes_add_fingerprint(const char *key, size_t index)
+{
+	const struct route orig = routes.routes[index];
+	if (!orig.body.ready || orig.alias || orig.variant_of) return -1;
+
+	struct route *r = route_new(key, orig.body.mime_type, orig.body.status,
+		orig.body.mtime);
+	if (!r) return -1;
+
+	r->body.len = orig.body.len;
+	r->body.hash = orig.body.hash;
+	r->body.immutable = 1;
+	r->ext = orig.ext;
+	r->text_off = orig.text_off;
+	r->fingerprint_of = index + 1;
+
+	r->not_modified_off = arena_push_not_modified(&r->body);
+	if (r->not_modified_off == (size_t) -1) return -1;
+
+	r->head_off = arena_push_head(&r->body, 0);
+	if (r->head_off == (size_t) -1) return -1;
+
+	routes.routes[index].fingerprint = routes.count;
+	return routes.count - 1;
+}
+
+ssize_t
+routes_alias(const char *key, size_t index)
+{
+	const struct route orig = routes.routes[index];
+
+	struct route *r = route_new(key, orig.body.mime_type, orig.body.status,
+		orig.body.mtime);
+	if (!r) return -1;
+
+	r->alias = index + 1;
+	return routes.count - 1;
+}
+
+/* Serializes filling lazy bodies. Each body is only filled once, and it's
+ * rare enough that there's nothing to gain from finer locking. */
+static pthread_mutex_t fill_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static void
+fill_body(struct response_body *body)
+{
+	size_t len;
+	char *text = body->fill(body->arg, &len);
+	if (!text) return;
+
+	body->len = len;
+	body->hash = routes_hash(text, len);
+	if (alloc_heads(body) != 0) {
+		free(text);
+		return;
+	}
+
+	body->text = text;
+	__atomic_store_n(&body->ready, 1, __ATOMIC_RELEASE);
+}
+
+const struct response_body *
+routes_ready(const struct response_body *body)
+{
+	if (__atomic_load_n(&body->ready, __ATOMIC_ACQUIRE))
+		return body;
+
+	// the store hands out const pointers, but it owns the body.
+	struct response_body *b = (struct response_body *) body;
+
+	pthread_mutex_lock(&fill_lock);
+	if (!b->ready) fill_body(b);
+	pthread_mutex_unlock(&fill_lock);
+
+	return b->ready ? b : NULL;
+}
+
+static int
+attach_copy(struct response_body *orig, enum route_encoding encoding,
+	char *text, size_t len)
+{
+	struct response_body *copy = malloc(sizeof(*copy));
+	if (!copy) return 1;
+
+	// the original is ready, or it wouldn't be compressed, so its mime
+	// type and status are settled.
+	*copy = (struct response_body) {
+		.mime_type = orig->mime_type,
+		.status = orig->status,
+		.text = text,
+		.len = len,
+		.hash = orig->hash,
+		.mtime = orig->mtime,
+		.immutable = orig->immutable,
+		.ready = 1,
+		.encoding = routes_encoding_name(encoding),
+	};
+
+	if (alloc_heads(copy) != 0) {
+		free(copy);
+		return 1;
+	}
+
+	const struct response_body *none = NULL;
+	if (!__atomic_compare_exchange_n(&orig->encoded[encoding], &none, copy,
+			0, __ATOMIC_RELEASE, __ATOMIC_RELAXED)) {
+		free((char *) copy->head);
+		free(copy);
+		return 1;
+	}
+
+	return 0;
+}
+
+int
+routes_attach_encoded(size_t index, enum route_encoding encoding,
+	char *text, size_t len)
+{
+	const struct route *r = &routes.routes[index];
+	if (attach_copy(&routes.routes[index].body, encoding, text, len) != 0)
+		return 1;
+
+	// the fingerprinted name shares the text. if it misses out, it's
+	// only served uncompressed.
+	if (r->fingerprint)
+		attach_copy(&routes.routes[r->fingerprint - 1].body, encoding,
+			text, len);
+
+	return 0;
+}
+
+/* Parse an IMF-fixdate, the only HTTP date format anyone still sends. Returns
+ * -1 if it isn't one. */
+static time_t
+parse_http_date(const char *s, size_t len)
+{
+	static const char months[] = "JanFebMarAprMayJunJulAugSepOctNovDec";
+
+	char buf[64], mon[4];
+	if (len >= sizeof(buf)) return -1;
+	memcpy(buf, s, len);
+	buf[len] = '\0';
+
+	struct tm tm;
+	memset(&tm, 0, sizeof(tm));
+	if (sscanf(buf, "%*3s, %2d %3s %4d %2d:%2d:%2d GMT", &tm.tm_mday, mon,
+			&tm.tm_year, &tm.tm_hour, &tm.tm_min, &tm.tm_sec) != 6)
+		return -1;
+
+	const char *m = strstr(months, mon);
+	if (!m || strlen(mon) != 3 || (m - months) % 3 != 0) return -1;
+
+	tm.tm_mon = (m - months) / 3;
+	tm.tm_year -= 1900;
+	return timegm(&tm);
+}
+
+int
+routes_fresh(const struct response_body *body,
+	const char *if_none_match, size_t inm_len,
+	const char *if_modified_since, size_t ims_len)
+{
+	if (!body->not_modified) return 0;
+
+	// If-Modified-Since only counts when there's no If-None-Match.
+	if (!if_none_match) {
+		time_t since = if_modified_since
+			? parse_http_date(if_modified_since, ims_len)
+			: -1;
+
+		return body->mtime && since != -1 && body->mtime <= since;
+	}
+
+	char etag[48];
+	format_etag(etag, sizeof(etag), body);
+	size_t etag_len = strlen(etag);
+
+	// our ETags never contain commas, so splitting on them is safe even
+	// if it mangles someone else's.
+	const char *p = if_none_match, *end = if_none_match + inm_len;
+	while (p < end) {
+		while (p < end && (*p == ',' || isspace((unsigned char) *p)))
+			p++;
+
+		const char *tag = p;
+		while (p < end && *p != ',')
+			p++;
+
+		const char *tag_end = p;
+		while (tag_end > tag && isspace((unsigned char) tag_end[-1]))
+			tag_end--;
+
+		if (tag_end - tag == 1 && *tag == '*') return 1;
+
+		// GETs use the weak comparison, so a W/ doesn't matter.
+		if (tag_end - tag >= 2 && tag[0] == 'W' && tag[1] == '/')
+			tag += 2;
+
+		if ((size_t) (tag_end - tag) == etag_len
+				&& memcmp(tag, etag, etag_len) == 0)
+			return 1;
+	}
+
+	return 0;
+}
+
+/* Parse a run of digits at *p into *n, moving *p past them. Returns nonzero
+ * if there are none, or too many to fit. */
+static int
+parse_size(const char **p, const char *end, size_t *n)
+{
+	const char *start = *p;
+	*n = 0;
+
+	for (; *p < end && isdigit((unsigned char) **p); (*p)++) {
+		if (*n > ((size_t) -1 - 9) / 10) return 1;
+		*n = *n * 10 + (**p - '0');
+	}
+
+	return *p == start;
+}
+
+int
+routes_ranges(const struct response_body *body, const char *spec, size_t len,
+	struct byte_range *ranges, int max)
+{
+	if (body->status != 200) return -1;
+
+	const char *p = spec, *end = spec + len;
+	if (len < 6 || strncasecmp(p, "bytes=", 6) != 0) return -1;
+	p += 6;
+
+	int n = 0;
+	while (p < end) {
+		while (p < end && (*p == ',' || isspace((unsigned char) *p)))
+			p++;
+		if (p == end) break;
+
+		// first-last, first-, or -suffix.
+		size_t first = 0, last = (size_t) -1;
+		int suffix = *p == '-';
+		if (!suffix && parse_size(&p, end, &first) != 0) return -1;
+		if (p == end || *p++ != '-') return -1;
+		if (p < end && isdigit((unsigned char) *p)
+				&& parse_size(&p, end, &last) != 0)
+			return -1;
+		if (suffix && last == (size_t) -1) return -1;
+		if (!suffix && last < first) return -1;
+
+		while (p < end && isspace((unsigned char) *p))
+			p++;
+		if (p < end && *p != ',') return -1;
+
+		if (suffix) {
+			if (last == 0) continue;
+			first = last >= body->len ? 0 : body->len - last;
+			last = body->len - 1;
+		} else if (last >= body->len) {
+			last = body->len - 1;
+		}
+
+		// ranges past the end can't be satisfied, and are left out.
+		if (first >= body->len) continue;
+
+		// more ranges than we'll send is more likely abuse than a
+		// download manager, so they get the whole thing instead.
+		if (n == max) return -1;
+		ranges[n++] = (struct byte_range) { first, last };
+	}
+
+	return n;
+}
+
+int
+routes_if_range(const struct response_body *body, const char *value,
+	size_t len)
+{
+	while (len > 0 && isspace((unsigned char) value[len - 1]))
+		len--;
+
+	// an entity tag must match strongly...
+	if (len > 0 && (value[0] == '"' || value[0] == 'W')) {
+		char etag[48];
+		format_etag(etag, sizeof(etag), body);
+		return strlen(etag) == len && memcmp(etag, value, len) == 0;
+	}
+
+	// ...and a date exactly.
+	time_t date = parse_http_date(value, len);
+	return body->mtime && date != -1 && date == body->mtime;
+}
+
+/* The multipart boundary for body's ranges. It only has to stay out of the
+ * body, and a hash of it won't be in it. */
+static void
+format_boundary(char *boundary, size_t size, const struct response_body *body)
+{
+	snprintf(boundary, size, "range-%016llx",
+		(unsigned long long) ~body->hash);
+}
+
+int
+routes_format_part(char *buf, size_t size, const struct response_body *body,
+	const struct byte_range *range)
+{
+	char boundary[32];
+	format_boundary(boundary, sizeof(boundary), body);
+
+	int len = range
+		? snprintf(buf, size,
+			"\r\n--%s\r\n"
+			"Content-Type: %s\r\n"
+			"Content-Range: bytes %zu-%zu/%zu\r\n"
+			"\r\n",
+			boundary, body->mime_type, range->first, range->last,
+			body->len)
+		: snprintf(buf, size, "\r\n--%s--\r\n", boundary);
+
+	return len < 0 || (size > 0 && len >= (int) size) ? -1 : len;
+}
+
+int
+routes_format_partial(char *buf, size_t size, const struct response_body *body,
+	const struct byte_range *ranges, int n)
+{
+	char shared[SHARED_MAX];
+	format_shared(shared, sizeof(shared), body);
+
+	char type[64], content_range[80] = "";
+	size_t content_len = 0;
+
+	if (n == 1) {
+		snprintf(type, sizeof(type), "%s", body->mime_type);
+		snprintf(content_range, sizeof(content_range),
+			"Content-Range: bytes %zu-%zu/%zu\r\n",
+			ranges[0].first, ranges[0].last, body->len);
+		content_len = ranges[0].last - ranges[0].first + 1;
+	} else {
+		char boundary[32];
+		format_boundary(boundary, sizeof(boundary), body);
+		snprintf(type, sizeof(type), "multipart/byteranges; boundary=%s",
+			boundary);
+
+		for (int i = 0; i <= n; i++) {
+			int part = routes_format_part(NULL, 0, body, i < n ? &ranges[i] : NULL);
+			if (part < 0) return -1;
+
+			content_len += part;
+			if (i < n)
+				content_len += ranges[i].last - ranges[i].first + 1;
+		}
+	}
+
+	int len = snprintf(buf, size,
+		"HTTP/1.1 206 Partial Content\r\n"
+		"Content-Type: %s\r\n"
+		"%s%s%s"
+		"%s"
+		"%s"
+		"Content-Length: %zu\r\n"
+		"\r\n",
+		type,
+		body->encoding ? "Content-Encoding: " : "",
+		body->encoding ? body->encoding : "",
+		body->encoding ? "\r\n" : "",
+		content_range, shared, content_len);
+
+	return len < 0 || len >= (int) size ? -1 : len;
+}
+
+int
+routes_format_unsatisfiable(char *buf, size_t size,
+	const struct response_body *body)
+{
+	int len = snprintf(buf, size,
+		"HTTP/1.1 416 Range Not Satisfiable\r\n"
+		"Content-Range: bytes */%zu\r\n"
+		"Content-Length: 0\r\n"
+		"\r\n",
+		body->len);
+
+	return len < 0 || len >= (int) size ? -1 : len;
+}
+
+/* Parse the q parameter of an Accept-Encoding item, in thousandths. Items
+ * without one are fully acceptable; malformed ones aren't acceptable at all. */
+static int
+parse_qvalue(const char *p, const char *end)
+{
+	while (p < end && (*p == ' ' || *p == '\t'))
+		p++;
+	if (end - p < 2 || (p[0] != 'q' && p[0] != 'Q') || p[1] != '=')
+		return 1000;
+
+	p += 2;
+	if (p == end || (*p != '0' && *p != '1'))
+		return 0;
+
+	int q = (*p++ - '0') * 1000;
+	if (p < end && *p == '.') {
+		p++;
+		for (int scale = 100; scale > 0 && p < end && isdigit((unsigned char) *p);
+				scale /= 10)
+			q += (*p++ - '0') * scale;
+	}
+
+	return q > 1000 ? 1000 : q;
+}
+
+const struct response_body *
+routes_negotiate(const struct response_body *body, const char *accept,
+	size_t len)
+{
+	// q-values in thousandths for each encoding, and for "*". -1 where
+	// the client didn't say.
+	int q[ENCODINGS], any = -1;
+	for (int i = 0; i < ENCODINGS; i++)
+		q[i] = -1;
+
+	const char *p = accept, *end = accept ? accept + len : NULL;
+	while (p && p < end) {
+		const char *comma = memchr(p, ',', end - p);
+		const char *stop = comma ? comma : end;
+		const char *semi = memchr(p, ';', stop - p);
+		const char *name_end = semi ? semi : stop;
+
+		while (p < name_end && isspace((unsigned char) *p))
+			p++;
+		while (name_end > p && isspace((unsigned char) name_end[-1]))
+			name_end--;
+
+		size_t name_len = name_end - p;
+		int weight = semi ? parse_qvalue(semi + 1, stop) : 1000;
+
+		if (name_len == 1 && *p == '*') {
+			any = weight;
+		} else if (name_len == 6 && strncasecmp(p, "x-gzip", 6) == 0) {
+			q[ENCODING_GZIP] = weight;
+		} else {
+			for (int i = 0; i < ENCODINGS; i++) {
+				const char *name = routes_encoding_name(i);
+				if (strlen(name) == name_len
+						&& strncasecmp(p, name, name_len) == 0)
+					q[i] = weight;
+			}
+		}
+
+		p = comma ? comma + 1 : end;
+	}
+
+	// take the compressed copy the client likes best, if it likes any.
+	// ties go to the earlier encoding, which is usually the smaller.
+	const struct response_body *best = body;
+	int best_q = 0;
+	for (int i = 0; i < ENCODINGS; i++) {
+		int weight = q[i] >= 0 ? q[i] : any >= 0 ? any : 0;
+		const struct response_body *copy
+			= __atomic_load_n(&body->encoded[i], __ATOMIC_ACQUIRE);
+
+		if (copy && weight > best_q) {
+			best = copy;
+			best_q = weight;
+		}
+	}
+
+	return best;
+}
+
+const struct response_body *
+routes_get(const char *ref, size_t len)
+{
+	while (len > 0 && isspace((unsigned char) ref[len - 1]))
+		len--;
+
+	uint32_t hash = hash_route(ref, len);
+	for (uint32_t i = hash & routes.mask;; i = (i + 1) & routes.mask) {
+		uint32_t slot = routes.table[i];
+		if (slot == 0)
+			return NULL;
+
+		const struct route *r = &routes.routes[slot - 1];
+		if (r->hash == hash && r->route_len == len
+				&& memcmp(r->route, ref, len) == 0)
+			return &routes.routes[r->alias ? r->alias - 1 : slot - 1].body;
+	}
+}
+
+static struct route *
+find_loaded(const char *key)
+{
+	for (size_t i = 0; i < routes.count; i++) {
+		if (strcmp(routes.arena + routes.routes[i].route_off, key) == 0)
+			return &routes.routes[i];
+	}
+
+	return NULL;
+}
+
+static void
+resolve_route(struct route *r)
+{
+	r->route = routes.arena + r->route_off;
+	if (r->alias || !r->body.ready) return;
+
+	r->body.head = routes.arena + r->head_off;
+	r->body.text = r->ext ? r->ext : routes.arena + r->text_off;
+	if (r->body.not_modified_len)
+		r->body.not_modified = routes.arena + r->not_modified_off;
+}
+
+int
+routes_seal(void)
+{
+	// the 404 page gets a second head with the right status, in front of
+	// the same body.
+	struct route *page = find_loaded("404");
+	if (!page || page->alias || !page->body.ready) return 1;
+
+	// compressed copies aren't attached yet, so this one has none; they'd
+	// carry the wrong status anyway.
+	routes.not_found = page->body;
+	routes.not_found.status = 404;
+	routes.not_found.not_modified = NULL;
+	routes.not_found.not_modified_len = 0;
+
+	size_t nf_off = arena_push_head(&routes.not_found, 0);
+	if (nf_off == (size_t) -1) return 1;
+
+	// give back the slack from doubling; nothing moves after this.
+	if (routes.arena_len > 0) {
+		char *arena = realloc(routes.arena, routes.arena_len);
+		if (arena) {
+			routes.arena = arena;
+			routes.arena_cap = routes.arena_len;
+		}
+	}
+
+	uint32_t size = 8;
+	while (size < 2 * routes.count)
+		size *= 2;
+
+	routes.table = calloc(size, sizeof(*routes.table));
+	if (!routes.table) return 1;
+	routes.mask = size - 1;
+
+	for (size_t i = 0; i < routes.count; i++) {
+		struct route *r = &routes.routes[i];
+		resolve_route(r);
+		r->hash = hash_route(r->route, r->route_len);
+
+		if (r->variant_of) {
+			routes.routes[r->variant_of - 1].body.encoded[r->encoding]
+				= &r->body;
+			continue;
+		}
+
+		uint32_t j = r->hash & routes.mask;
+		while (routes.table[j] != 0)
+			j = (j + 1) & routes.mask;
+		routes.table[j] = i + 1;
+	}
+
+	routes.not_found.head = routes.arena + nf_off;
+	routes.not_found.text = page->body.text;
+	return 0;
+}
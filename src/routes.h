@@ -0,0 +1,224 @@
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+#include <time.h>
+
+/* The content codings a route may have a precompressed copy in, in the order
+ * they're preferred when a client takes more than one equally. */
+enum route_encoding {
+	ENCODING_BR,
+	ENCODING_ZSTD,
+	ENCODING_GZIP,
+	ENCODINGS,
+};
+
+struct response_body {
+	const char *mime_type;
+	int status;
+
+	// the status line and headers, ready for the wire.
+	const char *head;
+	size_t head_len;
+
+	// the body: len bytes of arbitrary data. bodies copied into the arena
+	// sit right after their head, so the two go out as one buffer.
+	const char *text;
+	size_t len;
+
+	// the validators. the ETag is made from hash, a routes_hash() of the
+	// original body, so it changes exactly when the content does. mtime is
+	// zero if it isn't known.
+	uint64_t hash;
+	time_t mtime;
+
+	// served under a fingerprinted name (see assets.h), and so cacheable
+	// forever.
+	int immutable;
+
+	// a bodiless 304, with the same validators as head. NULL for routes
+	// that aren't 200s, which are never answered with a 304.
+	const char *not_modified;
+	size_t not_modified_len;
+
+	// bodies added with routes_add_lazy() aren't filled in until they're
+	// first needed. until ready is set, nothing but fill and arg is valid;
+	// see routes_ready().
+	int ready;
+	char *(*fill)(void *arg, size_t *len);
+	void *arg;
+
+	// the Content-Encoding of this body, or NULL for the original.
+	const char *encoding;
+
+	// precompressed copies of the original, by encoding. NULL where
+	// there's none. copies may be attached after the store is sealed, so
+	// read these with an acquire load.
+	const struct response_body *encoded[ENCODINGS];
+};
+
+struct route {
+	const char *route;
+	size_t route_len;
+	uint32_t hash;
+	struct response_body body;
+
+	// another name for the route at this index, plus one. zero if this
+	// route has its own body.
+	size_t alias;
+
+	// if nonzero, this is a compressed copy of the route at this index,
+	// plus one, in the given encoding. copies have no name of their own
+	// and aren't in the lookup table.
+	size_t variant_of;
+	enum route_encoding encoding;
+
+	// a route under a fingerprinted name shares its body with the route
+	// under the plain one. each has the other's index, plus one, here.
+	size_t fingerprint_of;
+	size_t fingerprint;
+
+	// while loading, the arena may move, so keys and bodies are kept as
+	// offsets into it. routes_seal() turns them into pointers. a body that
+	// isn't in the arena at all is kept in ext.
+	size_t route_off;
+	size_t head_off;
+	size_t text_off;
+	size_t not_modified_off;
+	const char *ext;
+};
+
+/* All routes, plus the one contiguous arena holding every key and head, and
+ * every body that isn't referenced in place. The store grows as routes are
+ * added and is frozen by routes_seal(), after which nothing in it moves or
+ * changes. */
+struct route_store {
+	struct route *routes;
+	size_t count;
+	size_t cap;
+
+	char *arena;
+	size_t arena_len;
+	size_t arena_cap;
+
+	// slots hold an index into routes plus one, so that zero is empty. the
+	// table is a power of two and at most half full.
+	uint32_t *table;
+	uint32_t mask;
+
+	// the 404 page, but served with a 404 status.
+	struct response_body not_found;
+};
+
+extern struct route_store routes;
+
+/* 64-bit FNV-1a, for ETags and route image checksums. */
+uint64_t routes_hash(const void *data, size_t len);
+
+/* Work out how the archive entry named route is served: its mime type and
+ * status. Returns nonzero if it's markup, to be rendered into HTML. */
+int routes_classify(const char *route, const char **mime_type, int *status);
+
+/* Whether bodies of this mime type are worth compressing. Responses for these
+ * always carry Vary: Accept-Encoding, whether or not a compressed copy exists
+ * yet. */
+int routes_compressible(const char *mime_type);
+
+/* The name of an encoding, as used in Content-Encoding and Accept-Encoding. */
+const char *routes_encoding_name(enum route_encoding);
+
+/* Add a route, copying the key and body into the arena behind a pre-built
+ * status line and headers. A len < 0 means the body is null-terminated. mtime
+ * is when the content last changed, or zero if that isn't known. Returns the
+ * index of the new route, or -1 on OOM. */
+ssize_t routes_add(const char *key, const char *mime_type, int status,
+	const char *body, ssize_t len, time_t mtime);
+
+/* Add a route whose body is served in place. The body must stay put and
+ * unchanged for the life of the process. hash is its routes_hash(), which the
+ * caller may have to hand already. Returns as routes_add. */
+ssize_t routes_add_ref(const char *key, const char *mime_type, int status,
+	const char *body, size_t len, time_t mtime, uint64_t hash);
+
+/* Add a route whose body is produced on first request, by calling fill with
+ * arg. fill returns the allocated body and sets its length, or returns NULL
+ * on failure, in which case it'll be tried again on the next request. The
+ * body is then kept for the life of the process. Returns as routes_add. */
+ssize_t routes_add_lazy(const char *key, const char *mime_type, int status,
+	char *(*fill)(void *arg, size_t *len), void *arg, time_t mtime);
+
+/* Add a copy of the route at index, compressed in the given encoding, served
+ * in place like routes_add_ref. Returns as routes_add. */
+ssize_t routes_add_encoded(size_t index, enum route_encoding,
+	const char *body, size_t len);
+
+/* Add the fingerprinted name for the route at index, which must be ready.
+ * It's served with the same body, but with a Cache-Control that lets it be
+ * cached forever. Compressed copies attached to the route at index after the
+ * store is sealed are attached to this one too. Returns as routes_add. */
+ssize_t routes_add_fingerprint(const char *key, size_t index);
+
+/* Add another name for an existing route. Returns as routes_add. */
+ssize_t routes_alias(const char *key, size_t index);
+
+/* Resolve arena offsets and build the lookup table. No routes may be added
+ * afterwards. Returns nonzero on OOM or if there's no 404 page. */
+int routes_seal(void);
+
+/* Find a route by name, ignoring trailing whitespace. NULL if there's none. */
+const struct response_body *routes_get(const char *ref, size_t len);
+
+/* Attach a compressed copy to the route at index once the store is sealed,
+ * taking ownership of the len bytes at text. Any thread may do this while
+ * others are serving the route; they'll go on getting the original until the
+ * copy is in place. Returns nonzero on OOM, or if the route already has a copy
+ * in that encoding; text is then still the caller's. */
+int routes_attach_encoded(size_t index, enum route_encoding,
+	char *text, size_t len);
+
+/* Whether a request with these If-None-Match and If-Modified-Since header
+ * values, either of which may be NULL, can be answered with body's
+ * not_modified response. */
+int routes_fresh(const struct response_body *body,
+	const char *if_none_match, size_t inm_len,
+	const char *if_modified_since, size_t ims_len);
+
+/* A byte range of a body, inclusive at both ends. */
+struct byte_range {
+	size_t first;
+	size_t last;
+};
+
+/* Parse a Range header value for body into at most max ranges. Returns how
+ * many there are, or 0 if none of them can be satisfied, or -1 if the header
+ * should be ignored and the whole body sent: it's malformed, asks for too many
+ * ranges, or body isn't a 200. */
+int routes_ranges(const struct response_body *body, const char *spec,
+	size_t len, struct byte_range *ranges, int max);
+
+/* Whether an If-Range header value lets a Range be served from body: it must
+ * be body's ETag, or its exact Last-Modified date. */
+int routes_if_range(const struct response_body *body, const char *value,
+	size_t len);
+
+/* Format the head of a 206 for n ranges of body into buf. With more than one,
+ * the body is multipart: each range is preceded by routes_format_part() and
+ * the whole is ended by routes_format_part() with no range. These all return
+ * the length formatted, or -1 if it won't fit; routes_format_part() measures
+ * with a NULL buf. */
+int routes_format_partial(char *buf, size_t size,
+	const struct response_body *body, const struct byte_range *ranges, int n);
+int routes_format_part(char *buf, size_t size,
+	const struct response_body *body, const struct byte_range *range);
+
+/* Format a 416 for body into buf, as routes_format_partial(). */
+int routes_format_unsatisfiable(char *buf, size_t size,
+	const struct response_body *body);
+
+/* Pick the best representation of body for a request with the given
+ * Accept-Encoding header value, which may be NULL if there was none. */
+const struct response_body *routes_negotiate(const struct response_body *body,
+	const char *accept, size_t len);
+
+/* Make sure body is filled in, filling it if it's lazy and this is its first
+ * request. Safe to call from any thread. NULL if filling it failed. */
+const struct response_body *routes_ready(const struct response_body *body);
@@ -0,0 +1,57 @@
+#include <stdio.h>
+#include <time.h>
+
+#include "startup.h"
+
+static const char *phase_names[STARTUP_PHASES] = {
+	[STARTUP_OPEN] = "open",
+	[STARTUP_INFLATE] = "inflate",
+	[STARTUP_RENDER] = "render",
+	[STARTUP_TABLE] = "table",
+	[STARTUP_LISTEN] = "listen",
+};
+
+static struct {
+	uint64_t ns;
+	uint64_t count;
+} phases[STARTUP_PHASES];
+
+static uint64_t began;
+
+uint64_t
+startup_now(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+void
+startup_begin(void)
+{
+	began = startup_now();
+}
+
+void
+startup_add(enum startup_phase phase, uint64_t start)
+{
+	uint64_t ns = startup_now() - start;
+	__atomic_fetch_add(&phases[phase].ns, ns, __ATOMIC_RELAXED);
+	__atomic_fetch_add(&phases[phase].count, 1, __ATOMIC_RELAXED);
+}
+
+void
+startup_report(void)
+{
+	printf("startup:");
+	for (int i = 0; i < STARTUP_PHASES; i++) {
+		if (phases[i].count == 0) continue;
+
+		printf(" %s %.3fms", phase_names[i], phases[i].ns / 1e6);
+		if (phases[i].count > 1)
+			printf(" (x%llu)", (unsigned long long) phases[i].count);
+		printf(",");
+	}
+
+	printf(" %.3fms total\n", (startup_now() - began) / 1e6);
+}
@@ -0,0 +1,26 @@
+#include <stdint.h>
+
+/* Where the time between exec and serving goes. Phases that happen once per
+ * archive entry (inflating, rendering) are summed across entries and loader
+ * threads, so they measure work rather than wall time. */
+enum startup_phase {
+	STARTUP_OPEN,    // mapping the executable and indexing what's on it
+	STARTUP_INFLATE, // decompressing zip entries
+	STARTUP_RENDER,  // render_markup()
+	STARTUP_TABLE,   // adding routes and sealing the store
+	STARTUP_LISTEN,  // setting up the listener
+	STARTUP_PHASES,
+};
+
+/* Mark the start of startup, as early in main() as possible. */
+void startup_begin(void);
+
+/* Monotonic nanoseconds. */
+uint64_t startup_now(void);
+
+/* Charge the time since start, a startup_now() value, to phase. Safe to call
+ * from any thread. */
+void startup_add(enum startup_phase phase, uint64_t start);
+
+/* Log every phase, and the total since startup_begin(). */
+void startup_report(void);
@@ -0,0 +1,174 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include <zlib.h>
+
+#include "zip.h"
+
+#define EOCD_SIG 0x06054b50
+#define EOCD_LEN 22
+#define CDH_SIG 0x02014b50
+#define CDH_LEN 46
+#define LFH_SIG 0x04034b50
+#define LFH_LEN 30
+
+// the extended timestamp extra field, which Info-ZIP writes by default.
+#define EXTRA_UT 0x5455
+
+static uint16_t
+le16(const unsigned char *p)
+{
+	return p[0] | p[1] << 8;
+}
+
+static uint32_t
+le32(const unsigned char *p)
+{
+	return p[0] | p[1] << 8 | p[2] << 16 | (uint32_t) p[3] << 24;
+}
+
+/* Work out an entry's mtime from its central directory header h. */
+static time_t
+entry_mtime(const unsigned char *h)
+{
+	// in the central directory, the extended timestamp only ever carries
+	// the mtime: a flags byte, then seconds since the epoch.
+	const unsigned char *extra = h + CDH_LEN + le16(h + 28);
+	const unsigned char *end = extra + le16(h + 30);
+	while (end - extra >= 4) {
+		uint16_t id = le16(extra), size = le16(extra + 2);
+		if (size > end - extra - 4) break;
+
+		if (id == EXTRA_UT && size >= 5 && (extra[4] & 1))
+			return (int32_t) le32(extra + 5);
+
+		extra += 4 + size;
+	}
+
+	uint16_t t = le16(h + 12), d = le16(h + 14);
+	struct tm tm = {
+		.tm_sec = (t & 31) * 2,
+		.tm_min = (t >> 5) & 63,
+		.tm_hour = t >> 11,
+		.tm_mday = d & 31,
+		.tm_mon = ((d >> 5) & 15) - 1,
+		.tm_year = (d >> 9) + 80,
+	};
+
+	return timegm(&tm);
+}
+
+/* The end of central directory record is the last thing in the archive, save
+ * for a comment of up to 64k. Scan backwards for it. */
+static const unsigned char *
+find_eocd(const unsigned char *map, size_t len)
+{
+	if (len < EOCD_LEN) return NULL;
+
+	size_t stop = len > EOCD_LEN + 65535 ? len - EOCD_LEN - 65535 : 0;
+	for (size_t i = len - EOCD_LEN + 1; i-- > stop;) {
+		const unsigned char *p = map + i;
+		if (le32(p) == EOCD_SIG && i + EOCD_LEN + le16(p + 20) == len)
+			return p;
+	}
+
+	return NULL;
+}
+
+int
+zip_index(const unsigned char *map, size_t len,
+	struct zip_entry **entries, size_t *count)
+{
+	const unsigned char *eocd = find_eocd(map, len);
+	if (!eocd) return 1;
+
+	size_t n = le16(eocd + 10);
+	uint32_t cd_size = le32(eocd + 12);
+	uint32_t cd_off = le32(eocd + 16);
+
+	// zip64 archives mark these as saturated and store the real values
+	// elsewhere. we don't produce anything that big.
+	if (n == 0xffff || cd_size == 0xffffffff || cd_off == 0xffffffff)
+		return 1;
+
+	// offsets in the archive are relative to its own start, which is
+	// wherever the bytes before it (server.bin) end.
+	size_t cd = eocd - map;
+	if (cd_size > cd || cd - cd_size < cd_off) return 1;
+	cd -= cd_size;
+	size_t base = cd - cd_off;
+
+	struct zip_entry *out = calloc(n ? n : 1, sizeof(*out));
+	if (!out) return 1;
+
+	size_t at = cd;
+	for (size_t i = 0; i < n; i++) {
+		const unsigned char *h = map + at;
+		if (at + CDH_LEN > cd + cd_size || le32(h) != CDH_SIG)
+			goto bad;
+
+		uint16_t name_len = le16(h + 28);
+		size_t next = at + CDH_LEN + name_len + le16(h + 30) + le16(h + 32);
+		if (next > cd + cd_size) goto bad;
+
+		// bit 0 is encryption.
+		if (le16(h + 8) & 1) goto bad;
+
+		struct zip_entry *e = &out[i];
+		e->name = (const char *) h + CDH_LEN;
+		e->name_len = name_len;
+		e->method = le16(h + 10);
+		e->crc = le32(h + 16);
+		e->csize = le32(h + 20);
+		e->size = le32(h + 24);
+		e->mtime = entry_mtime(h);
+
+		// the local header repeats the name, and can have its own extra
+		// field, so its length has to be read from it.
+		size_t lfh = base + le32(h + 42);
+		if (lfh + LFH_LEN > cd || le32(map + lfh) != LFH_SIG)
+			goto bad;
+
+		size_t data = lfh + LFH_LEN + le16(map + lfh + 26)
+			+ le16(map + lfh + 28);
+		if (data > cd || e->csize > cd - data) goto bad;
+
+		// stored entries are served in place, e->size bytes from
+		// e->data, so that has to be just what was bounds-checked.
+		if (e->method == ZIP_STORED
+				&& (e->size != e->csize || e->size > cd - data))
+			goto bad;
+		e->data = map + data;
+
+		at = next;
+	}
+
+	*entries = out;
+	*count = n;
+	return 0;
+
+bad:
+	free(out);
+	return 1;
+}
+
+int
+zip_inflate(const struct zip_entry *e, unsigned char *out)
+{
+	z_stream zs;
+	memset(&zs, 0, sizeof(zs));
+
+	// negative window bits: raw deflate, no zlib header.
+	if (inflateInit2(&zs, -MAX_WBITS) != Z_OK) return 1;
+
+	zs.next_in = (unsigned char *) e->data;
+	zs.avail_in = e->csize;
+	zs.next_out = out;
+	zs.avail_out = e->size;
+
+	int r = inflate(&zs, Z_FINISH);
+	inflateEnd(&zs);
+
+	if (r != Z_STREAM_END || zs.total_out != e->size) return 1;
+	return crc32(0, out, e->size) != e->crc;
+}
@@ -0,0 +1,36 @@
+#include <stddef.h>
+#include <stdint.h>
+#include <time.h>
+
+#define ZIP_STORED 0
+#define ZIP_DEFLATED 8
+
+/* An entry in the central directory of a zip archive that lives in memory.
+ * name isn't null-terminated, and data points at the entry's raw, possibly
+ * compressed, bytes. */
+struct zip_entry {
+	const char *name;
+	size_t name_len;
+
+	int method;
+	uint32_t crc;
+	const unsigned char *data;
+	uint64_t csize;
+	uint64_t size;
+
+	// modification time, from the extended timestamp if there is one, or
+	// else the dos timestamp taken as utc.
+	time_t mtime;
+};
+
+/* Index the zip archive at the end of the len bytes at map, which may be
+ * preceded by anything (an executable, say). On success, *entries is an
+ * allocated array of *count entries in central directory order, and 0 is
+ * returned. Archives that we can't read in place (zip64, encrypted entries,
+ * stored entries whose two sizes differ, anything malformed) return nonzero. */
+int zip_index(const unsigned char *map, size_t len,
+	struct zip_entry **entries, size_t *count);
+
+/* Inflate a ZIP_DEFLATED entry into out, which must hold e->size bytes.
+ * Returns nonzero if the data is corrupt. */
+int zip_inflate(const struct zip_entry *e, unsigned char *out);
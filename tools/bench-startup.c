@@ -0,0 +1,144 @@
+/* Measure cold start: launch the server over and over, and time from exec to
+ * the first byte of a response to a local client.
+ *
+ *	usage: bench-startup [-n runs] [-p port] SERVER [ARGS...] */
+
+#include <arpa/inet.h>
+#include <errno.h>
+#include <netinet/in.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+static double
+now_ms(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1e3 + ts.tv_nsec / 1e6;
+}
+
+/* Try once to fetch / and read a byte of the response. Returns nonzero if the
+ * server isn't up yet. */
+static int
+probe(int port)
+{
+	int fd = socket(AF_INET, SOCK_STREAM, 0);
+	if (fd < 0) return 1;
+
+	struct sockaddr_in sin = {
+		.sin_family = AF_INET,
+		.sin_port = htons(port),
+		.sin_addr.s_addr = htonl(INADDR_LOOPBACK),
+	};
+
+	static const char req[] = "GET / HTTP/1.1\r\nConnection: close\r\n\r\n";
+	char c;
+	int r = connect(fd, (struct sockaddr *) &sin, sizeof(sin)) != 0
+		|| write(fd, req, sizeof(req) - 1) != sizeof(req) - 1
+		|| read(fd, &c, 1) != 1;
+
+	close(fd);
+	return r;
+}
+
+/* One cold start. Returns milliseconds from fork to first byte, or < 0. */
+static double
+run(char **argv, int port)
+{
+	double start = now_ms();
+
+	pid_t pid = fork();
+	if (pid < 0) return -1;
+	if (pid == 0) {
+		freopen("/dev/null", "w", stdout);
+		execv(argv[0], argv);
+		_exit(127);
+	}
+
+	double took = -1;
+	while (now_ms() - start < 10000) {
+		if (probe(port) == 0) {
+			took = now_ms() - start;
+			break;
+		}
+
+		int status;
+		if (waitpid(pid, &status, WNOHANG) == pid) {
+			fprintf(stderr, "bench-startup: server exited early\n");
+			return -1;
+		}
+
+		usleep(50);
+	}
+
+	kill(pid, SIGKILL);
+	waitpid(pid, NULL, 0);
+	return took;
+}
+
+static int
+cmp(const void *a, const void *b)
+{
+	double x = *(const double *) a, y = *(const double *) b;
+	return (x > y) - (x < y);
+}
+
+static double
+pct(const double *v, int n, double p)
+{
+	int i = (int) (p / 100 * (n - 1) + 0.5);
+	return v[i];
+}
+
+int
+main(int argc, char **argv)
+{
+	int runs = 50, port = 18080, opt;
+
+	while ((opt = getopt(argc, argv, "+n:p:")) != -1) {
+		switch (opt) {
+		case 'n': runs = atoi(optarg); break;
+		case 'p': port = atoi(optarg); break;
+		default: goto usage;
+		}
+	}
+
+	if (optind >= argc || runs < 1) goto usage;
+
+	// pass the port on to the server, after whatever args it was given.
+	int sargc = argc - optind;
+	char **sargv = calloc(sargc + 3, sizeof(*sargv));
+	char portarg[16];
+	snprintf(portarg, sizeof(portarg), "%d", port);
+	memcpy(sargv, argv + optind, sargc * sizeof(*sargv));
+	sargv[sargc] = "-p";
+	sargv[sargc + 1] = portarg;
+
+	if (probe(port) == 0) {
+		fprintf(stderr, "bench-startup: something's already on port %d\n", port);
+		return 1;
+	}
+
+	double *v = calloc(runs, sizeof(*v));
+	for (int i = 0; i < runs; i++) {
+		v[i] = run(sargv, port);
+		if (v[i] < 0) return 1;
+	}
+
+	qsort(v, runs, sizeof(*v), cmp);
+	printf("bench-startup: %d runs of %s, exec to first byte\n", runs, sargv[0]);
+	printf("  min %.2fms  p50 %.2fms  p90 %.2fms  p99 %.2fms  max %.2fms\n",
+		v[0], pct(v, runs, 50), pct(v, runs, 90), pct(v, runs, 99),
+		v[runs - 1]);
+	return 0;
+
+usage:
+	fprintf(stderr, "usage: bench-startup [-n runs] [-p port] SERVER [ARGS...]\n");
+	return 1;
+}
@@ -0,0 +1,317 @@
+/* Check Range handling end to end: launch the server, then make a 416, a
+ * single range, a suffix range and a multi-range request for one route, one
+ * after another on a single keep-alive connection. Every part has to match
+ * the whole body, and every response has to end exactly where its
+ * Content-Length says, or the next one won't parse.
+ *
+ *	usage: check-ranges [-p port] [-u path] SERVER [ARGS...] */
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <signal.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+/* A connection, with whatever's been read but not yet taken. */
+struct conn {
+	int fd;
+	char buf[1 << 20];
+	size_t len;
+};
+
+/* One response, taken off a connection. */
+struct response {
+	int status;
+	char head[4096];
+	char *body;
+	size_t len;
+};
+
+static int failures;
+
+static void
+fail(const char *what, const char *fmt, ...)
+{
+	va_list ap;
+	va_start(ap, fmt);
+	fprintf(stderr, "check-ranges: %s: ", what);
+	vfprintf(stderr, fmt, ap);
+	fputc('\n', stderr);
+	va_end(ap);
+	failures++;
+}
+
+static int
+dial(int port)
+{
+	int fd = socket(AF_INET, SOCK_STREAM, 0);
+	if (fd < 0) return -1;
+
+	struct sockaddr_in sin = {
+		.sin_family = AF_INET,
+		.sin_port = htons(port),
+		.sin_addr.s_addr = htonl(INADDR_LOOPBACK),
+	};
+
+	if (connect(fd, (struct sockaddr *) &sin, sizeof(sin)) != 0) {
+		close(fd);
+		return -1;
+	}
+
+	// a broken server shouldn't hang the check.
+	struct timeval tv = { .tv_sec = 5 };
+	setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+	return fd;
+}
+
+/* Read until c holds at least want bytes. Nonzero if it never does. */
+static int
+fill(struct conn *c, size_t want)
+{
+	while (c->len < want) {
+		if (want > sizeof(c->buf)) return 1;
+		ssize_t n = read(c->fd, c->buf + c->len, sizeof(c->buf) - c->len);
+		if (n <= 0) return 1;
+		c->len += n;
+	}
+	return 0;
+}
+
+/* The value of header name in head, or NULL. */
+static const char *
+header(const char *head, const char *name)
+{
+	size_t len = strlen(name);
+	for (const char *p = strstr(head, "\r\n"); p; p = strstr(p + 2, "\r\n")) {
+		if (strncasecmp(p + 2, name, len) == 0 && p[2 + len] == ':')
+			return p + 3 + len + strspn(p + 3 + len, " ");
+	}
+	return NULL;
+}
+
+/* Send a GET for path, with a Range header if range isn't NULL, and take its
+ * response off c. Nonzero if there isn't a well-formed one. */
+static int
+get(struct conn *c, const char *path, const char *range, struct response *r)
+{
+	char req[512];
+	int len = snprintf(req, sizeof(req), "GET %s HTTP/1.1\r\nHost: x\r\n"
+		"%s%s%s\r\n", path, range ? "Range: " : "", range ? range : "",
+		range ? "\r\n" : "");
+	if (write(c->fd, req, len) != len) return 1;
+
+	// the head.
+	char *end;
+	c->buf[c->len] = 0;
+	while (!(end = strstr(c->buf, "\r\n\r\n"))) {
+		if (fill(c, c->len + 1) != 0 || c->len == sizeof(c->buf)) return 1;
+		c->buf[c->len] = 0;
+	}
+
+	size_t head_len = end + 4 - c->buf;
+	if (head_len >= sizeof(r->head)) return 1;
+	memcpy(r->head, c->buf, head_len);
+	r->head[head_len] = 0;
+	if (sscanf(r->head, "HTTP/1.1 %d ", &r->status) != 1) return 1;
+
+	// the body, exactly as long as the head says.
+	const char *cl = header(r->head, "Content-Length");
+	if (!cl) return 1;
+	r->len = strtoul(cl, NULL, 10);
+	if (fill(c, head_len + r->len) != 0) return 1;
+
+	r->body = malloc(r->len + 1);
+	memcpy(r->body, c->buf + head_len, r->len);
+	r->body[r->len] = 0;
+
+	c->len -= head_len + r->len;
+	memmove(c->buf, c->buf + head_len + r->len, c->len);
+	return 0;
+}
+
+/* Check that r has header name with value want. */
+static void
+expect_header(const char *what, const struct response *r, const char *name,
+	const char *want)
+{
+	const char *v = header(r->head, name);
+	if (!v || strncmp(v, want, strlen(want)) != 0
+			|| strncmp(v + strlen(want), "\r\n", 2) != 0)
+		fail(what, "%s is not %s", name, want);
+}
+
+/* Check that a range of body is at p, as the bytes first to last. */
+static void
+expect_range(const char *what, const char *p, size_t len,
+	const struct response *whole, size_t first, size_t last)
+{
+	if (len != last - first + 1 || memcmp(p, whole->body + first, len) != 0)
+		fail(what, "bytes %zu-%zu don't match the body", first, last);
+}
+
+static void
+check(struct conn *c, const char *path)
+{
+	struct response whole, r;
+	char want[128];
+
+	if (get(c, path, NULL, &whole) != 0 || whole.status != 200
+			|| whole.len < 100) {
+		fail("setup", "%s isn't a 200 of at least 100 bytes", path);
+		return;
+	}
+
+	size_t n = whole.len;
+
+	// nothing to send: a bodiless 416, and the connection goes on.
+	if (get(c, path, "bytes=999999999-", &r) != 0) {
+		fail("416", "no response");
+		return;
+	}
+	if (r.status != 416) fail("416", "status %d", r.status);
+	snprintf(want, sizeof(want), "bytes */%zu", n);
+	expect_header("416", &r, "Content-Range", want);
+	free(r.body);
+
+	if (get(c, path, "bytes=10-19", &r) != 0) {
+		fail("single", "no response");
+		return;
+	}
+	if (r.status != 206) fail("single", "status %d", r.status);
+	snprintf(want, sizeof(want), "bytes 10-19/%zu", n);
+	expect_header("single", &r, "Content-Range", want);
+	expect_range("single", r.body, r.len, &whole, 10, 19);
+	free(r.body);
+
+	if (get(c, path, "bytes=-25", &r) != 0) {
+		fail("suffix", "no response");
+		return;
+	}
+	if (r.status != 206) fail("suffix", "status %d", r.status);
+	snprintf(want, sizeof(want), "bytes %zu-%zu/%zu", n - 25, n - 1, n);
+	expect_header("suffix", &r, "Content-Range", want);
+	expect_range("suffix", r.body, r.len, &whole, n - 25, n - 1);
+	free(r.body);
+
+	// each part has its own head; the whole ends with the boundary.
+	if (get(c, path, "bytes=0-4,50-59", &r) != 0) {
+		fail("multi", "no response");
+		return;
+	}
+	if (r.status != 206) fail("multi", "status %d", r.status);
+	const char *type = header(r.head, "Content-Type");
+	const char *b = type ? strstr(type, "boundary=") : NULL;
+	if (!b) {
+		fail("multi", "no multipart boundary");
+	} else {
+		char boundary[64];
+		sscanf(b + 9, "%63[^\r\n;]", boundary);
+
+		size_t ranges[2][2] = { { 0, 4 }, { 50, 59 } };
+		const char *p = r.body;
+		for (int i = 0; i < 2; i++) {
+			char part[256];
+			int len = snprintf(part, sizeof(part), "\r\n--%s\r\n", boundary);
+			if (strncmp(p, part, len) != 0) {
+				fail("multi", "part %d doesn't start with the boundary", i);
+				break;
+			}
+
+			const char *data = strstr(p, "\r\n\r\n");
+			snprintf(want, sizeof(want), "Content-Range: bytes %zu-%zu/%zu\r\n",
+				ranges[i][0], ranges[i][1], n);
+			if (!data || !strstr(p, want) || strstr(p, want) > data) {
+				fail("multi", "part %d has the wrong Content-Range", i);
+				break;
+			}
+
+			data += 4;
+			size_t len_i = ranges[i][1] - ranges[i][0] + 1;
+			expect_range("multi", data, len_i, &whole, ranges[i][0],
+				ranges[i][1]);
+			p = data + len_i;
+		}
+
+		snprintf(want, sizeof(want), "\r\n--%s--\r\n", boundary);
+		if (strcmp(p, want) != 0)
+			fail("multi", "doesn't end with the closing boundary");
+	}
+	free(r.body);
+
+	// and after all that, the connection is still in step.
+	if (get(c, path, NULL, &r) != 0 || r.status != 200 || r.len != n
+			|| memcmp(r.body, whole.body, n) != 0)
+		fail("after", "a plain GET on the same connection went wrong");
+	else
+		free(r.body);
+
+	free(whole.body);
+}
+
+int
+main(int argc, char **argv)
+{
+	int port = 18081, opt;
+	const char *path = "/teapot.png";
+
+	while ((opt = getopt(argc, argv, "+p:u:")) != -1) {
+		switch (opt) {
+		case 'p': port = atoi(optarg); break;
+		case 'u': path = optarg; break;
+		default: goto usage;
+		}
+	}
+
+	if (optind >= argc) goto usage;
+
+	int sargc = argc - optind;
+	char **sargv = calloc(sargc + 3, sizeof(*sargv));
+	char portarg[16];
+	snprintf(portarg, sizeof(portarg), "%d", port);
+	memcpy(sargv, argv + optind, sargc * sizeof(*sargv));
+	sargv[sargc] = "-p";
+	sargv[sargc + 1] = portarg;
+
+	int fd = dial(port);
+	if (fd >= 0) {
+		fprintf(stderr, "check-ranges: something's already on port %d\n", port);
+		return 1;
+	}
+
+	pid_t pid = fork();
+	if (pid < 0) return 1;
+	if (pid == 0) {
+		freopen("/dev/null", "w", stdout);
+		execv(sargv[0], sargv);
+		_exit(127);
+	}
+
+	for (int i = 0; i < 1000 && (fd = dial(port)) < 0; i++)
+		usleep(10 * 1000);
+
+	if (fd < 0) {
+		fprintf(stderr, "check-ranges: %s never came up\n", sargv[0]);
+	} else {
+		static struct conn c;
+		c.fd = fd;
+		check(&c, path);
+		close(fd);
+	}
+
+	kill(pid, SIGKILL);
+	waitpid(pid, NULL, 0);
+
+	if (fd < 0 || failures) return 1;
+	printf("check-ranges: %s ok\n", path);
+	return 0;
+
+usage:
+	fprintf(stderr, "usage: check-ranges [-p port] [-u path] SERVER [ARGS...]\n");
+	return 1;
+}
@@ -0,0 +1,313 @@
+/* Build a route image (see src/image.h) from the files in res/. Every markup
+ * page is rendered here, once, instead of on every server start, and every
+ * compressible body is compressed here too: always with gzip, and with brotli
+ * or zstd if built with them (see src/compress.h).
+ *
+ *	usage: mkimage OUT FILE... */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+
+#include "../src/assets.h"
+#include "../src/image.h"
+#include "../src/markup.h"
+#include "../src/routes.h"
+#include "../src/compress.h"
+
+struct entry {
+	char *key;
+	const char *mime_type;
+	int status;
+	char *body;
+	size_t len;
+	time_t mtime;
+
+	// for a compressed copy or fingerprinted name, as in struct
+	// image_route.
+	enum route_encoding encoding;
+	size_t base;
+	uint32_t flags;
+};
+
+static struct entry *entries;
+static size_t count;
+
+static void
+die(const char *what, const char *why)
+{
+	fprintf(stderr, "mkimage: %s: %s\n", what, why);
+	exit(1);
+}
+
+static char *
+read_file(const char *path, size_t *len)
+{
+	FILE *f = fopen(path, "rb");
+	if (!f) die(path, "can't open");
+
+	char *buf = NULL;
+	size_t cap = 0;
+	*len = 0;
+
+	for (;;) {
+		if (*len == cap) {
+			cap = cap ? cap * 2 : 65536;
+			buf = realloc(buf, cap);
+			if (!buf) die(path, "OOM");
+		}
+
+		size_t n = fread(buf + *len, 1, cap - *len, f);
+		*len += n;
+		if (n == 0) break;
+	}
+
+	if (ferror(f)) die(path, "read error");
+	fclose(f);
+	return buf;
+}
+
+static size_t
+add_entry(const char *key, const char *mime_type, int status, char *body,
+	size_t len)
+{
+	entries = realloc(entries, (count + 1) * sizeof(*entries));
+	if (!entries) die(key, "OOM");
+
+	entries[count] = (struct entry) {
+		.key = strdup(key),
+		.mime_type = mime_type,
+		.status = status,
+		.body = body,
+		.len = len,
+	};
+
+	return count++;
+}
+
+/* Add a compressed copy of the entry at base. */
+static void
+add_copy(size_t base, enum route_encoding encoding, char *body, size_t len)
+{
+	const struct entry *b = &entries[base];
+	size_t i = add_entry(b->key, b->mime_type, b->status, body, len);
+	entries[i].mtime = entries[base].mtime;
+	entries[i].encoding = encoding;
+	entries[i].base = base + 1;
+}
+
+/* Add every compressed copy of the entry at base that's worth having. */
+static void
+add_copies(size_t base)
+{
+	if (!routes_compressible(entries[base].mime_type)) return;
+
+	for (int i = 0; i < ENCODINGS; i++) {
+		size_t len;
+		char *body = compress_body(i, entries[base].body, entries[base].len,
+			&len);
+		if (!body) continue;
+
+		if (len >= entries[base].len) {
+			free(body);
+			continue;
+		}
+
+		add_copy(base, i, body, len);
+	}
+}
+
+/* Add another entry called key, sharing the body and compressed copies of the
+ * entry at base, which must be the last one added, along with its copies. */
+static size_t
+add_same(const char *key, size_t base)
+{
+	size_t copies = count - base - 1;
+	size_t same = add_entry(key, entries[base].mime_type,
+		entries[base].status, entries[base].body, entries[base].len);
+	entries[same].mtime = entries[base].mtime;
+
+	for (size_t i = 1; i <= copies; i++)
+		add_copy(same, entries[base + i].encoding, entries[base + i].body,
+			entries[base + i].len);
+
+	return same;
+}
+
+/* Add the file at path, if it goes in the given assets_rank(). */
+static void
+add_file(const char *path, int rank)
+{
+	// routes are named like the archive entries were: by basename.
+	const char *key = strrchr(path, '/');
+	key = key ? key + 1 : path;
+
+	const char *mime_type;
+	int status;
+	int is_markup = routes_classify(key, &mime_type, &status);
+	if (assets_rank(is_markup, mime_type) != rank) return;
+
+	size_t len;
+	char *body = read_file(path, &len);
+
+	struct stat st;
+	if (stat(path, &st) != 0) die(path, "can't stat");
+
+	if (is_markup) {
+		char *html = render_markup(body, len);
+		if (!html) die(path, "OOM while rendering");
+
+		free(body);
+		body = html;
+		len = strlen(html);
+	}
+
+	if (is_markup || assets_refers(mime_type)) {
+		char *rewritten = assets_rewrite(body, len, &len);
+		if (!rewritten) die(path, "OOM while rewriting");
+
+		free(body);
+		body = rewritten;
+	}
+
+	size_t base = add_entry(key, mime_type, status, body, len);
+	entries[base].mtime = st.st_mtime;
+	add_copies(base);
+
+	if (!is_markup) {
+		const char *fingerprint = assets_add(key, routes_hash(body, len));
+		if (!fingerprint) die(path, "OOM");
+
+		size_t twin = add_same(fingerprint, base);
+		entries[twin].base = base + 1;
+		entries[twin].flags = IMAGE_FINGERPRINT;
+	}
+
+	// the "" alias gets index's body and copies, shared.
+	if (strcmp(key, "index") == 0)
+		add_same("", base);
+}
+
+static uint64_t
+align8(uint64_t n)
+{
+	return (n + 7) & ~(uint64_t) 7;
+}
+
+static void
+put(FILE *f, const void *data, size_t len, const char *out)
+{
+	if (len > 0 && fwrite(data, len, 1, f) != 1) die(out, "write error");
+}
+
+int
+main(int argc, char **argv)
+{
+	if (argc < 2) {
+		fprintf(stderr, "usage: mkimage OUT FILE...\n");
+		return 1;
+	}
+
+	const char *out = argv[1];
+	for (int rank = 0; rank < ASSETS_RANKS; rank++) {
+		for (int i = 2; i < argc; i++)
+			add_file(argv[i], rank);
+	}
+
+	// lay out the metadata: records, then the strings they point at.
+	struct image_route *recs = calloc(count ? count : 1, sizeof(*recs));
+	size_t strings_cap = 0;
+	for (size_t i = 0; i < count; i++)
+		strings_cap += strlen(entries[i].key) + strlen(entries[i].mime_type) + 2;
+
+	char *strings = malloc(strings_cap ? strings_cap : 1);
+	if (!recs || !strings) die(out, "OOM");
+
+	uint64_t at = sizeof(struct image_header) + count * sizeof(*recs);
+	size_t strings_len = 0;
+
+	for (size_t i = 0; i < count; i++) {
+		const char *s[2] = { entries[i].key, entries[i].mime_type };
+		uint64_t *off[2] = { &recs[i].key, &recs[i].mime_type };
+
+		for (int j = 0; j < 2; j++) {
+			size_t n = strlen(s[j]) + 1;
+			memcpy(strings + strings_len, s[j], n);
+			*off[j] = at + strings_len;
+			strings_len += n;
+		}
+	}
+
+	struct image_header hdr;
+	memset(&hdr, 0, sizeof(hdr));
+	memcpy(hdr.magic, IMAGE_MAGIC, sizeof(hdr.magic));
+	hdr.version = IMAGE_VERSION;
+	hdr.count = count;
+	hdr.meta_len = count * sizeof(*recs) + strings_len;
+
+	// then the bodies, 8-byte aligned. the "" alias shares index's
+	// bodies.
+	at = align8(sizeof(hdr) + hdr.meta_len);
+	for (size_t i = 0; i < count; i++) {
+		recs[i].len = entries[i].len;
+		recs[i].status = entries[i].status;
+		recs[i].mtime = entries[i].mtime;
+		recs[i].encoding = entries[i].encoding;
+		recs[i].base = entries[i].base;
+		recs[i].flags = entries[i].flags;
+		recs[i].content_hash = routes_hash(entries[i].body, entries[i].len);
+
+		size_t j = 0;
+		while (j < i && entries[j].body != entries[i].body)
+			j++;
+
+		if (j < i) {
+			recs[i].body = recs[j].body;
+			continue;
+		}
+
+		recs[i].body = at;
+		at = align8(at + entries[i].len);
+	}
+
+	struct image_trailer trailer;
+	memcpy(trailer.magic, IMAGE_MAGIC, sizeof(trailer.magic));
+	trailer.size = hdr.size = at + sizeof(trailer);
+
+	// the checksum covers the records and strings exactly as written.
+	char *meta = malloc(hdr.meta_len ? hdr.meta_len : 1);
+	if (!meta) die(out, "OOM");
+	memcpy(meta, recs, count * sizeof(*recs));
+	memcpy(meta + count * sizeof(*recs), strings, strings_len);
+	hdr.meta_sum = routes_hash(meta, hdr.meta_len);
+
+	FILE *f = fopen(out, "wb");
+	if (!f) die(out, "can't open");
+
+	static const char zeros[8];
+	put(f, &hdr, sizeof(hdr), out);
+	put(f, meta, hdr.meta_len, out);
+	uint64_t written = sizeof(hdr) + hdr.meta_len;
+
+	for (size_t i = 0; i < count; i++) {
+		if (recs[i].body < written) continue;
+
+		put(f, zeros, recs[i].body - written, out);
+		put(f, entries[i].body, entries[i].len, out);
+		written = recs[i].body + entries[i].len;
+	}
+
+	put(f, zeros, at - written, out);
+	put(f, &trailer, sizeof(trailer), out);
+
+	if (fclose(f) != 0) die(out, "write error");
+
+	size_t copies = 0;
+	for (size_t i = 0; i < count; i++)
+		copies += entries[i].base && !(entries[i].flags & IMAGE_FINGERPRINT);
+
+	printf("mkimage: %zu routes, %zu compressed copies, %llu bytes\n",
+		count - copies, copies, (unsigned long long) hdr.size);
+	return 0;
+}